@@ -0,0 +1,20 @@
+/**
+ *
+ * \file
+ *
+ * CRC-32 on the CRC peripheral.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#ifndef PROJECT_INC_CRC32_H_
+#define PROJECT_INC_CRC32_H_
+
+#include <stdint.h>
+
+void crc32_init(void);
+void crc32_update(const uint32_t *data, uint32_t length);
+uint32_t crc32_final(void);
+
+#endif /* PROJECT_INC_CRC32_H_ */
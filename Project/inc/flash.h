@@ -23,6 +23,22 @@
 #define QSPI_NOT_SUPPORTED ((uint8_t)0x04)
 #define QSPI_SUSPENDED     ((uint8_t)0x08)
 
+/* Base of the memory mapped QSPI window */
+#define FLASH_MAPPED_BASE	0x90000000
+
+/* QSPI FIFO size in bytes */
+#define QSPI_FIFO_DEPTH			32
+
+/* QSPI FIFO threshold in bytes (1..32), FTF is raised when this many bytes can be moved */
+#define QSPI_FIFO_THRESHOLD		16
+
+/* QSPI clock cycles between two status reads in automatic polling mode */
+#define QSPI_POLL_INTERVAL		16
+#define QSPI_POLL_INTERVAL_LONG	0xFFFF		// ~1ms at 72MHz, for chip erase
+
+/* Iterations of a tight status flag poll before giving up */
+#define QSPI_SPIN_TIMEOUT		1000000
+
 
 /* Definition for QSPI clock resources */
 #define QSPI_CLK_ENABLE()          __HAL_RCC_QSPI_CLK_ENABLE()
@@ -34,9 +50,70 @@
 #define QSPI_D2_GPIO_CLK_ENABLE()  __HAL_RCC_GPIOE_CLK_ENABLE()
 #define QSPI_D3_GPIO_CLK_ENABLE()  __HAL_RCC_GPIOD_CLK_ENABLE()
 
+#define QSPI_DMA_CLK_ENABLE()      __HAL_RCC_DMA2_CLK_ENABLE()
+
 #define QSPI_FORCE_RESET()         __HAL_RCC_QSPI_FORCE_RESET()
 #define QSPI_RELEASE_RESET()       __HAL_RCC_QSPI_RELEASE_RESET()
 
+/* Definition for QSPI DMA (DMA2 Stream 7, Channel 3) */
+#define QSPI_DMA_STREAM				DMA2_Stream7
+#define QSPI_DMA_CHANNEL			DMA_CHANNEL_3
+#define QSPI_DMA_STATUS()			(DMA2->HISR)
+#define QSPI_DMA_FLAG_TC			DMA_HISR_TCIF7
+#define QSPI_DMA_FLAG_TE			(DMA_HISR_TEIF7 | DMA_HISR_DMEIF7)
+#define QSPI_DMA_CLEAR_FLAGS()		(DMA2->HIFCR = DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | \
+										DMA_HIFCR_CTEIF7 | DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7)
+
+#define QSPI_DMA_MIN_SIZE			256			// smaller reads are cheaper through the FIFO
+#define QSPI_WRITE_DMA				1			// feed page program data by DMA instead of the CPU
+#define QSPI_QPI_MODE				0			// run the session in QPI (4-4-4) mode
+
+#define QSPI_PRESCALER				2			// fixed clock prescaler, 216MHz / 3 => 72MHz
+#define QSPI_CALIBRATE				1			// sweep prescaler, sample shift and pin speed at init
+#define QSPI_CALIB_REF_CLOCK		24000000	// bus clock in Hz the reference readback is taken at
+#define QSPI_CALIB_ADDR				0			// flash area read back at every candidate setting, must hold varied data
+#define QSPI_CALIB_SIZE				256			// bytes per part, at most QSPI_STREAM_CHUNK in all
+#define QSPI_CALIB_PASSES			4			// readbacks that must all match per candidate
+#define QSPI_STREAM_CHUNK			4096		// size of each of the two flash_stream bounce buffers
+#define QSPI_DUAL_FLASH				0			// two parts side by side in dual-flash mode, even bytes in BK1
+#define QSPI_DUAL_BANK				0			// two parts one after the other, BK2 above BK1, selected by FSEL
+#define QSPI_MIRROR					0			// two parts holding the same image, every byte on both in dual-flash mode
+
+#if (QSPI_DUAL_FLASH + QSPI_DUAL_BANK + QSPI_MIRROR) > 1
+#error "QSPI_DUAL_FLASH, QSPI_DUAL_BANK and QSPI_MIRROR are exclusive"
+#endif
+
+/*
+ * Geometry as seen through the QUADSPI. QSPI_CHIPS parts are driven in
+ * parallel, and QSPI_MEM_SCALE loader bytes sit on each byte of one part:
+ * both parts make up each block in dual-flash mode, in mirror mode the
+ * second part only holds a copy.
+ */
+#if QSPI_DUAL_FLASH
+#define QSPI_CHIPS					2
+#define QSPI_MEM_SCALE				2
+#elif QSPI_MIRROR
+#define QSPI_CHIPS					2
+#define QSPI_MEM_SCALE				1
+#else
+#define QSPI_CHIPS					1
+#define QSPI_MEM_SCALE				1
+#endif
+#if QSPI_DUAL_BANK
+#define QSPI_BANKS					2
+#else
+#define QSPI_BANKS					1
+#endif
+#define QSPI_BANK_SIZE				(FLASH_DEV_FLASH_SIZE * QSPI_MEM_SCALE)
+#define QSPI_MEM_SIZE				(QSPI_BANK_SIZE * QSPI_BANKS)
+#define QSPI_MEM_SECTOR_SIZE		(FLASH_DEV_SECTOR_SIZE * QSPI_MEM_SCALE)
+#define QSPI_MEM_HALFSECTOR_SIZE	(FLASH_DEV_HALFSECTOR_SIZE * QSPI_MEM_SCALE)
+#define QSPI_MEM_SUBSECTOR_SIZE		(FLASH_DEV_SUBSECTOR_SIZE * QSPI_MEM_SCALE)
+#define QSPI_MEM_PAGE_SIZE			(FLASH_DEV_PAGE_SIZE * QSPI_MEM_SCALE)
+
+/* QUADSPI address of a loader address, mirror mode keeps every byte twice */
+#define QSPI_ADDR(a)				((a) * (QSPI_CHIPS / QSPI_MEM_SCALE))
+
 /* Definition for QSPI Pins */
 #define QSPI_CLK_PIN             	GPIO_PIN_2	// AF 9
 #define QSPI_CLK_GPIO_PORT         	GPIOB
@@ -83,10 +160,28 @@ typedef enum blocksize_e
 	BLOCKSIZE_ALL
 }blocksize_e;
 
+/*
+ * Consumer of flash_stream data. 'data' is word aligned, 'length' in bytes;
+ * a last partial word is zero padded.
+ */
+typedef void (*flash_sink_t)(const uint32_t *data, uint32_t length, void *ctx);
+
 int flash_read( uint32_t address, uint8_t *pdata, uint32_t length);
+int flash_read_dma_start( uint32_t address, uint32_t *pdata, uint32_t length);
+int flash_read_dma_wait(void);
+int flash_stream( uint32_t address, uint32_t length, flash_sink_t sink, void *ctx);
+int flash_read_mapped( uint32_t address, uint8_t *pdata, uint32_t length);
+int flash_memmap_enable(void);
+const uint8_t *flash_map(uint32_t address);
+uint32_t flash_span(uint32_t address, uint32_t length);
 int flash_write( uint32_t address, uint8_t *pdata, uint32_t length);
 int flash_init(void);
 int flash_erase(uint32_t address, blocksize_e blocktype);
 int flash_chiperase();
+int flash_erase_range(uint32_t address, uint32_t length);
+int flash_wait(uint32_t address);
+int flash_sync(void);
+int flash_is_blank(uint32_t address, uint32_t length);
+void usleep(__IO uint32_t micros);
 
 #endif /* PROJECT_INC_FLASH_H_ */
@@ -24,7 +24,12 @@
 
 /* AT25QF641 Adesto memory */
 
-#define QSPI_SECTOR_SIZE                      4096
+#define QSPI_SECTOR_SIZE                      QSPI_MEM_SUBSECTOR_SIZE
+
+/* StreamWrite ring buffer, a power of two and a multiple of the page size */
+#define QSPI_RING_SIZE                        0x10000
+/* StreamWrite gives up when the host adds no data for this long, in ms */
+#define QSPI_RING_TIMEOUT                     5000
 
 
 /* End address of the QSPI memory */
@@ -57,10 +62,73 @@ extern uint32_t _qspi_init_length;
 #endif
 
 
+/* Result block of a digest entry point, left in RAM for the host */
+struct DigestResult
+{
+  uint32_t  Status;             // 1 digest valid, 0 failed
+  uint32_t  StartAddress;       // range the digest covers
+  uint32_t  Size;
+  uint8_t   Digest[32];
+};
+
+/*
+ * Ring buffer of a StreamWrite session. Byte n of the stream sits at
+ * Data[(StartAddress + n) % QSPI_RING_SIZE], so flash pages never wrap.
+ * The host writes data, then advances Head; the target advances Tail as
+ * the bytes are programmed. Both count bytes from the start of the stream.
+ */
+struct StreamRing
+{
+  volatile uint32_t Head;       // bytes written by the host
+  volatile uint32_t Tail;       // bytes programmed by the target
+  volatile uint32_t Status;     // 0 running, 1 done, 2 failed, 3 timed out
+  uint8_t   Data[QSPI_RING_SIZE];
+};
+
+/* Operations of a RunBatch descriptor */
+#define BATCH_ERASE                           1   // erase the sectors touching the range
+#define BATCH_PROGRAM                         2   // program Size bytes from Buffer
+#define BATCH_VERIFY                          3   // compare the range against Buffer
+#define BATCH_CRC                             4   // CRC-32 of the range into Result
+#define BATCH_BLANK_CHECK                     5   // check the range is erased
+
+/* Descriptor status, written back by RunBatch */
+#define BATCH_PENDING                         0   // not run
+#define BATCH_OK                              1
+#define BATCH_FAILED                          2
+
+/* One entry of a RunBatch command list, Status and Result are written in place */
+struct BatchCommand
+{
+  uint32_t  Op;                 // BATCH_ERASE .. BATCH_BLANK_CHECK
+  uint32_t  Address;            // flash address
+  uint32_t  Size;               // bytes
+  uint32_t  Buffer;             // RAM data of BATCH_PROGRAM and BATCH_VERIFY
+  uint32_t  Status;             // BATCH_PENDING, BATCH_OK or BATCH_FAILED
+  uint32_t  Result;             // CRC-32, or the address of the first mismatch
+};
+
+/* WriteSparse container, the Android sparse image layout */
+#define SPARSE_HEADER_MAGIC                   0xED26FF3A
+#define SPARSE_HEADER_SIZE                    28  // minimum file header size
+#define SPARSE_CHUNK_HEADER_SIZE              12  // minimum chunk header size
+#define SPARSE_CHUNK_RAW                      0xCAC1  // data follows
+#define SPARSE_CHUNK_FILL                     0xCAC2  // one 32-bit pattern follows
+#define SPARSE_CHUNK_DONT_CARE                0xCAC3  // blocks left as they are
+#define SPARSE_CHUNK_CRC32                    0xCAC4  // checksum, not checked
+
 /* Private function prototypes -----------------------------------------------*/
 int Init (void);
 KeepInCompilation int Write (uint32_t Address, uint32_t Size, uint8_t* buffer);
+KeepInCompilation int StreamWrite (uint32_t StartAddress, uint32_t Size);
+KeepInCompilation int WriteLz4 (uint32_t Address, uint32_t Size, uint8_t* buffer);
+KeepInCompilation int WriteSparse (uint32_t Address, uint32_t Size, uint8_t* buffer);
 KeepInCompilation int SectorErase (uint32_t EraseStartAddress ,uint32_t EraseEndAddress);
+KeepInCompilation int MassErase (uint32_t Parallelism);
+KeepInCompilation uint64_t Crc32 (uint32_t StartAddress, uint32_t Size);
+KeepInCompilation int SectorCrcIndex (uint32_t StartAddress, uint32_t Size);
+KeepInCompilation int Sha256 (uint32_t StartAddress, uint32_t Size);
+KeepInCompilation int RunBatch (uint32_t ListAddress, uint32_t Count);
 KeepInCompilation uint64_t Verify (uint32_t MemoryAddr, uint32_t RAMBufferAddr, uint32_t Size, uint32_t missalignement);
 void SystemClock_Config(void);
 
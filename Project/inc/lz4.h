@@ -0,0 +1,26 @@
+/**
+ *
+ * \file
+ *
+ * LZ4 block decompression.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#ifndef PROJECT_INC_LZ4_H_
+#define PROJECT_INC_LZ4_H_
+
+#include <stdint.h>
+
+/*
+ * A compressed payload is a sequence of independent LZ4 blocks, each
+ * preceded by a header of two little-endian words: the compressed and the
+ * raw size of the block. Raw blocks are at most LZ4_MAX_BLOCK bytes.
+ */
+#define LZ4_HEADER_SIZE		8
+#define LZ4_MAX_BLOCK		0x10000
+
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+
+#endif /* PROJECT_INC_LZ4_H_ */
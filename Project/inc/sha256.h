@@ -0,0 +1,36 @@
+/**
+ *
+ * \file
+ *
+ * SHA-256 message digest.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#ifndef PROJECT_INC_SHA256_H_
+#define PROJECT_INC_SHA256_H_
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+#define SHA256_BLOCK_SIZE	64
+
+typedef struct sha256_ctx
+{
+	uint32_t	state[8];
+	uint32_t	length_lo;				//!< message length in bytes, low word
+	uint32_t	length_hi;				//!< message length in bytes, high word
+	uint32_t	fill;					//!< bytes waiting in block
+	union
+	{
+		uint8_t		b[SHA256_BLOCK_SIZE];
+		uint32_t	w[SHA256_BLOCK_SIZE / 4];
+	} block;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const uint8_t *data, uint32_t length);
+void sha256_final(sha256_ctx *ctx, uint8_t *digest);
+
+#endif /* PROJECT_INC_SHA256_H_ */
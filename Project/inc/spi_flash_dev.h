@@ -16,8 +16,12 @@
 
 #define FLASH_DEV_FLASH_SIZE        		0x800000 	// 64 MBits => 8MBytes
 #define FLASH_DEV_SECTOR_SIZE               0x10000   	// 128 sectors of 64KBytes
+#define FLASH_DEV_HALFSECTOR_SIZE           0x8000    	// 256 half sectors of 32kBytes
 #define FLASH_DEV_SUBSECTOR_SIZE            0x1000    	// 4096 subsectors of 4kBytes
 #define FLASH_DEV_PAGE_SIZE                 0x100     	// 65536 pages of 256 bytes
+#define FLASH_DEV_ERASE_VALUE               0xFF      	// content of erased memory
+
+#define FLASH_DEV_MAX_CLOCK                 133000000	// highest serial clock in Hz
 
 #define FLASH_DEV_DUMMY_CYCLES_READ_FAST    8
 #define FLASH_DEV_DUMMY_CYCLES_READ_QUAD    4
@@ -44,6 +48,10 @@
 #define QUAD_OUT_FAST_READ_CMD              0x6B
 #define QUAD_INOUT_FAST_READ_CMD            0xEB
 
+/* Mode byte of the quad I/O read, M5-4 = 10 keeps the device in continuous read */
+#define CONTINUOUS_READ_MODE                0x20
+#define CONTINUOUS_READ_EXIT                0xFF
+
 /* Write Operations */
 #define WRITE_ENABLE_CMD                    0x06
 #define WRITE_DISABLE_CMD                   0x04
@@ -67,6 +75,12 @@
 #define PROG_ERASE_SUSPEND_CMD             	0x75
 #define PROG_ERASE_RESUME_CMD          		0x7A
 
+/* QPI Operations */
+#define ENTER_QPI_CMD                       0x38
+#define EXIT_QPI_CMD                        0xFF
+#define SET_READ_PARAM_CMD                  0xC0		// QPI mode only
+#define QPI_READ_PARAM_6_CLOCKS             0x20		// P5-P4 = 10, 6 clocks between address and data
+
 
 /** 
   * @brief  Registers
@@ -0,0 +1,63 @@
+/**
+ *
+ * \file
+ *
+ * CRC-32 on the CRC peripheral.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#include "stm32f7xx_hal.h"
+#include "crc32.h"
+
+/**
+ * Set up the CRC unit for CRC-32 as used by zlib/Ethernet:
+ * polynomial 0x04C11DB7, init 0xFFFFFFFF, reflected input and output.
+ * The final inversion is done in crc32_final.
+ */
+void crc32_init(void)
+{
+	__HAL_RCC_CRC_CLK_ENABLE();
+
+	CRC->POL  = 0x04C11DB7;
+	CRC->INIT = 0xFFFFFFFF;
+	CRC->CR   = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;	// bit reversal by byte, 32-bit polynomial
+	CRC->CR  |= CRC_CR_RESET;
+}
+
+/**
+ * Feed length bytes from a word aligned buffer.
+ * Words are byte swapped so the unit sees the bytes in memory order.
+ */
+void crc32_update(const uint32_t *data, uint32_t length)
+{
+	const uint8_t *tail;
+
+	while (length >= 16)
+	{
+		CRC->DR = __REV(data[0]);
+		CRC->DR = __REV(data[1]);
+		CRC->DR = __REV(data[2]);
+		CRC->DR = __REV(data[3]);
+		data += 4;
+		length -= 16;
+	}
+	while (length >= 4)
+	{
+		CRC->DR = __REV(*data++);
+		length -= 4;
+	}
+
+	tail = (const uint8_t *)data;
+	while (length--)
+		*(__IO uint8_t *)&CRC->DR = *tail++;
+}
+
+/**
+ * Read out the result.
+ */
+uint32_t crc32_final(void)
+{
+	return CRC->DR ^ 0xFFFFFFFF;
+}
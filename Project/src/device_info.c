@@ -11,6 +11,7 @@
  */
 
 #include <device_info.h>
+#include "flash.h"
 
 
 /* This structure containes information used by ST-LINK Utility to program and erase the device */
@@ -19,6 +20,37 @@ __root struct StorageInfo const StorageInfo  =  {
 #else
 __attribute__ ((section(".Dev_info"))) struct StorageInfo const StorageInfo  =  {
 #endif
+#if QSPI_DUAL_FLASH
+   "2xAT25QF641_STM32F767VGT6", 	 					    // Device Name + EVAL Board name
+   NOR_FLASH,                   					        // Device Type
+   0x90000000,                						        // Device Start Address
+   0x1000000,                 						        // Device Size in Bytes (16MBytes)
+   0x200,                    						        // Programming Page Size (512Bytes)
+   0xFF,                       						        // Initial Content of Erased Memory
+// Specify Size and Address of Sectors (view example below)
+   {{0x0000800, 0x000002000},     				 		   	// Sector Num : 2048 ,Sector Size: 8KBytes
+   {0x00000000, 0x00000000}}								// End of list
+#elif QSPI_MIRROR
+   "AT25QF641_mirror_STM32F767VGT6", 	 					// Device Name + EVAL Board name
+   NOR_FLASH,                   					        // Device Type
+   0x90000000,                						        // Device Start Address
+   0x0800000,                 						        // Device Size in Bytes (8MBytes, on both parts)
+   0x100,                    						        // Programming Page Size (256Bytes)
+   0xFF,                       						        // Initial Content of Erased Memory
+// Specify Size and Address of Sectors (view example below)
+   {{0x0000800, 0x000001000},     				 		   	// Sector Num : 2048 ,Sector Size: 4KBytes
+   {0x00000000, 0x00000000}}								// End of list
+#elif QSPI_DUAL_BANK
+   "AT25QF641x2_STM32F767VGT6", 	 					    // Device Name + EVAL Board name
+   NOR_FLASH,                   					        // Device Type
+   0x90000000,                						        // Device Start Address
+   0x1000000,                 						        // Device Size in Bytes (16MBytes)
+   0x100,                    						        // Programming Page Size (256Bytes)
+   0xFF,                       						        // Initial Content of Erased Memory
+// Specify Size and Address of Sectors (view example below)
+   {{0x0001000, 0x000001000},     				 		   	// Sector Num : 4096 ,Sector Size: 4KBytes
+   {0x00000000, 0x00000000}}								// End of list
+#else
    "AT25QF641_STM32F767VGT6", 	 					        // Device Name + EVAL Board name
    NOR_FLASH,                   					        // Device Type
    0x90000000,                						        // Device Start Address
@@ -28,4 +60,5 @@ __attribute__ ((section(".Dev_info"))) struct StorageInfo const StorageInfo  =
 // Specify Size and Address of Sectors (view example below)
    {{0x0000800, 0x000001000},     				 		   	// Sector Num : 2048 ,Sector Size: 4KBytes
    {0x00000000, 0x00000000}}								// End of list
+#endif
 }; 
@@ -13,6 +13,41 @@
 #include "printf.h"
 #include "flash.h"
 
+/* CCR phases of the quad I/O fast read after the instruction, FMODE is or'ed in by the user */
+#define QSPI_QUAD_READ_PHASES	(QSPI_DATA_4_LINES | (FLASH_DEV_DUMMY_CYCLES_READ_QUAD << 18) | QSPI_ALTERNATE_BYTES_8_BITS | \
+							 QSPI_ALTERNATE_BYTES_4_LINES | QSPI_ADDRESS_24_BITS | QSPI_ADDRESS_4_LINES)
+
+/* Full quad I/O fast read, or only the address phase on when the device is in continuous read */
+#define QSPI_QUAD_READ_CCR	(continuous ? QSPI_QUAD_READ_PHASES : \
+							 (QSPI_QUAD_READ_PHASES | INSTR_LINES | QUAD_INOUT_FAST_READ_CMD))
+
+/* Line setup of the instruction and of the single line phases, 4 lines each in QPI mode */
+#define INSTR_LINES			(qpi ? QSPI_INSTRUCTION_4_LINES : QSPI_INSTRUCTION_1_LINE)
+#define ADDR_LINES			(qpi ? QSPI_ADDRESS_4_LINES : QSPI_ADDRESS_1_LINE)
+#define DATA_LINES			(qpi ? QSPI_DATA_4_LINES : QSPI_DATA_1_LINE)
+
+/* Erase value replicated into every byte lane of a word */
+#define ERASED_WORD			(FLASH_DEV_ERASE_VALUE * 0x01010101U)
+
+/* Status register bits of every part, dual-flash mode returns one status byte per part */
+#define SR_ALL(x)			((x) * (QSPI_CHIPS > 1 ? 0x0101U : 1U))
+
+static int memmapped;		//!< set while the QUADSPI is in memory mapped mode
+static int qpi;				//!< set while the flash is in QPI (4-4-4) mode
+static int continuous;		//!< set while the flash is in continuous read, expecting an address instead of an opcode
+
+#if QSPI_DUAL_BANK
+static uint32_t pending[QSPI_BANKS];	//!< max time of an erase still running on each part, 0 when idle
+#endif
+
+/* Bounce buffers for flash_stream, one is consumed while the DMA fills the other */
+static uint32_t stream_buffer[2][QSPI_STREAM_CHUNK / 4];
+
+#if QSPI_CHIPS > 1
+/* Page data padded out to even address and size, or doubled up for mirror mode */
+static uint8_t pad_buffer[FLASH_DEV_PAGE_SIZE * QSPI_CHIPS];
+#endif
+
 /**
  * @brief  Delays for amount of micro seconds
  * @param  micros: Number of microseconds for delay
@@ -59,20 +94,310 @@ static int inline wait_flag(uint32_t flag, int state, uint32_t ms)
 	return 0;			// ok
 }
 
+//
+// tight-loop variant of wait_flag, for the data phase of a transfer
+// where the next FIFO event is only a few bus clocks away
+//
+static int inline spin_flag(uint32_t flag)
+{
+	uint32_t n = QSPI_SPIN_TIMEOUT;
+
+	while ((QUADSPI->SR & flag) == 0)
+	{
+		if (--n == 0)	// if timeout
+			return 1;	// error
+	}
+	return 0;			// ok
+}
+
+//
+// drain Size bytes from the FIFO into pData.
+// Bytes are popped singly until the destination is word aligned, then in
+// 32-bit words, as many as the FIFO level says are there, and the last
+// 0..3 bytes singly again.
+//
+static int read_fifo(uint8_t *pData, uint32_t Size)
+{
+	__IO uint32_t *data_reg = &QUADSPI->DR;
+	uint32_t *pword;
+	uint32_t words;
+
+	// head, up to word alignment of the destination
+	while (Size && ((uint32_t)pData & 3))
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*pData++ = *(__IO uint8_t *)data_reg;
+		Size--;
+	}
+
+	// body, one burst per FIFO threshold event
+	while (Size >= 4)
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+
+		words = (QUADSPI->SR & QUADSPI_SR_FLEVEL) >> (QUADSPI_SR_FLEVEL_Pos + 2);
+		if (words > (Size >> 2))
+			words = Size >> 2;
+		Size -= words << 2;
+
+		pword = (uint32_t *)pData;
+		while (words--)
+			*pword++ = *data_reg;
+		pData = (uint8_t *)pword;
+	}
+
+	// tail
+	while (Size)
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*pData++ = *(__IO uint8_t *)data_reg;
+		Size--;
+	}
+
+	return 0;
+}
+
+//
+// fill the FIFO with Size bytes from pData.
+// Same shape as read_fifo: byte and halfword stores up to source word
+// alignment, then word bursts sized by the free FIFO space, then the tail.
+//
+static int write_fifo(const uint8_t *pData, uint32_t Size)
+{
+	__IO uint32_t *data_reg = &QUADSPI->DR;
+	const uint32_t *pword;
+	uint32_t words;
+
+	// head, up to word alignment of the source
+	if (Size && ((uint32_t)pData & 1))
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*(__IO uint8_t *)data_reg = *pData++;
+		Size--;
+	}
+	if (Size >= 2 && ((uint32_t)pData & 2))
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*(__IO uint16_t *)data_reg = *(const uint16_t *)pData;
+		pData += 2;
+		Size -= 2;
+	}
+
+	// body, one burst per FIFO threshold event
+	while (Size >= 4)
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+
+		words = (QSPI_FIFO_DEPTH - ((QUADSPI->SR & QUADSPI_SR_FLEVEL) >> QUADSPI_SR_FLEVEL_Pos)) >> 2;
+		if (words > (Size >> 2))
+			words = Size >> 2;
+		Size -= words << 2;
+
+		pword = (const uint32_t *)pData;
+		while (words--)
+			*data_reg = *pword++;
+		pData = (const uint8_t *)pword;
+	}
+
+	// tail
+	if (Size >= 2)
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*(__IO uint16_t *)data_reg = *(const uint16_t *)pData;
+		pData += 2;
+		Size -= 2;
+	}
+	if (Size)
+	{
+		if (spin_flag(QSPI_FLAG_FT) != 0)
+			return 1;
+		*(__IO uint8_t *)data_reg = *pData;
+	}
+
+	return 0;
+}
+
+//
+// program and enable the QUADSPI DMA stream.
+// D-Cache is off in this loader, so no cache maintenance is needed on mem.
+//
+static void dma_arm(uint32_t cr, uint32_t par, void *mem, uint32_t items)
+{
+	DMA_Stream_TypeDef *stream = QSPI_DMA_STREAM;
+
+	stream->CR &= ~DMA_SxCR_EN;
+	while (stream->CR & DMA_SxCR_EN)
+		;
+	QSPI_DMA_CLEAR_FLAGS();
+
+	stream->PAR  = par;
+	stream->M0AR = (uint32_t)mem;
+	stream->NDTR = items;
+	stream->FCR  = DMA_FIFOMODE_ENABLE | DMA_FIFO_THRESHOLD_FULL;
+	stream->CR   = cr | DMA_PRIORITY_HIGH | DMA_MINC_ENABLE;
+	stream->CR  |= DMA_SxCR_EN;
+}
+
+//
+// arm the QUADSPI DMA stream for a transfer of 'words' 32-bit words between
+// the data register and 'mem'. dir is DMA_PERIPH_TO_MEMORY or DMA_MEMORY_TO_PERIPH.
+//
+static void dma_start(uint32_t dir, void *mem, uint32_t words)
+{
+	dma_arm(QSPI_DMA_CHANNEL | DMA_PDATAALIGN_WORD | DMA_MDATAALIGN_WORD | dir,
+			(uint32_t)&QUADSPI->DR, mem, words);
+
+	QUADSPI->CR |= QUADSPI_CR_DMAEN;
+}
+
+//
+// memory to memory copy on the QUADSPI DMA stream, used to pull data out of
+// the memory mapped window. width is 1 or 4, Size a multiple of it.
+//
+static void dma_copy(void *dst, const void *src, uint32_t Size, uint32_t width)
+{
+	uint32_t cr = DMA_MEMORY_TO_MEMORY | DMA_PINC_ENABLE;
+
+	if (width == 4)
+		cr |= DMA_PDATAALIGN_WORD | DMA_MDATAALIGN_WORD;
+
+	dma_arm(cr, (uint32_t)src, dst, Size / width);
+}
+
+//
+// wait for the QUADSPI DMA stream to finish, then hand the FIFO back to the CPU
+//
+static int dma_wait(uint32_t ms)
+{
+	int err = 0;
+
+	ms *= 1000;
+
+	while ((QSPI_DMA_STATUS() & QSPI_DMA_FLAG_TC) == 0)
+	{
+		if ((QSPI_DMA_STATUS() & QSPI_DMA_FLAG_TE) || --ms == 0)
+		{
+			err = 1;
+			break;
+		}
+		usleep(1);
+	}
+
+	if (QUADSPI->CR & QUADSPI_CR_DMAEN)
+		QUADSPI->CR &= ~QUADSPI_CR_DMAEN;
+	QSPI_DMA_STREAM->CR &= ~DMA_SxCR_EN;
+	QSPI_DMA_CLEAR_FLAGS();
+
+	return err;
+}
+
+#if QSPI_WRITE_DMA
+//
+// push one page worth of data by DMA.
+// Bytes up to source word alignment and the 0..3 byte tail go through the
+// FIFO, the word aligned body is handed to the DMA stream.
+//
+static int write_page_dma(const uint8_t *pData, uint32_t Size)
+{
+	uint32_t head, body;
+
+	head = (0 - (uint32_t)pData) & 3;
+	if (head > Size)
+		head = Size;
+	if (write_fifo(pData, head) != 0)
+		return 1;
+	pData += head;
+	Size -= head;
+
+	body = Size & ~3;
+	if (body)
+	{
+		dma_start(DMA_MEMORY_TO_PERIPH, (void *)pData, body >> 2);
+		if (dma_wait(1000) != 0)
+			return 1;
+	}
+
+	return write_fifo(pData + body, Size - body);
+}
+#endif
+
+
+//
+// leave memory mapped mode, if active, so an indirect command can be issued.
+// Aborting drops nCS and ends the pending prefetch.
+//
+static int indirect_mode(void)
+{
+	uint32_t n = QSPI_SPIN_TIMEOUT;
+
+	if (!memmapped)
+		return 0;
+
+	QUADSPI->CR |= QUADSPI_CR_ABORT;
+	while (QUADSPI->CR & QUADSPI_CR_ABORT)
+	{
+		if (--n == 0)
+			return 1;
+	}
+	QUADSPI->FCR = QSPI_FLAG_TC;
+	memmapped = 0;
+
+	return wait_flag(QSPI_FLAG_BUSY, RESET, 1000);
+}
+
+//
+// take the flash out of continuous read before a command with an opcode.
+// 8 clocks with all four lines high, a mode byte other than M5-4 = 10,
+// the sequence is also harmless (0xFF, exit QPI) on a device in SPI mode.
+//
+static int continuous_exit(void)
+{
+	if (indirect_mode() != 0)
+		return 1;
+
+	if (!continuous)
+		return 0;
+
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
+
+	/* Only an alternate bytes phase, writing CCR starts the transfer */
+	QUADSPI->ABR = (CONTINUOUS_READ_EXIT * 0x01010101U);
+	QUADSPI->CCR = QSPI_ALTERNATE_BYTES_32_BITS | QSPI_ALTERNATE_BYTES_4_LINES;
+
+	if (spin_flag(QSPI_FLAG_TC) != 0)
+		return 1;
+	QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
+
+	continuous = 0;
+
+	return 0;
+}
+
 
 static int send_single_command(uint8_t cmd)
 {
+	if (continuous_exit() != 0)
+		return 1;
+
 	// wait for not busy
 	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000))
 	{
 		return 1;
 	}
 
-    QUADSPI->CCR  = QSPI_INSTRUCTION_1_LINE | cmd | 0;
+    QUADSPI->CCR  = INSTR_LINES | cmd | 0;
 
 	// When there is no data phase, the transfer start as soon as the configuration is done
 	// so wait until TC flag is set to go back in idle state
-	if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
+	if (spin_flag(QSPI_FLAG_TC) == 0)
 	{
 		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
 		return 0;
@@ -83,54 +408,137 @@ static int send_single_command(uint8_t cmd)
 
 
 
-static int read_status_register(void)
+//
+// let the QUADSPI poll the status register in hardware until
+// (SR & mask) == match, the status match flag ends the wait.
+// interval is the QSPI clock count between two status reads, step_us how
+// often the CPU looks at the match flag, ms the timeout in milliseconds.
+//
+static int auto_poll(uint8_t mask, uint8_t match, uint16_t interval, uint32_t step_us, uint32_t ms)
 {
-    uint32_t addr_reg = QUADSPI->AR;
-    __IO uint32_t *data_reg = &QUADSPI->DR;
-    uint32_t length = 1;
-    uint8_t buffer[4];
-    uint8_t *pdata = buffer;
+	uint32_t n = QSPI_SPIN_TIMEOUT;
+
+	if (continuous_exit() != 0)
+		return 1;
+
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
 
-    QUADSPI->DLR = 0;
-    QUADSPI->CCR  = QSPI_INSTRUCTION_1_LINE | QSPI_DATA_1_LINE | READ_STATUS_REG_CMD | QUADSPI_CCR_FMODE_0;
+	QUADSPI->PSMKR = SR_ALL(mask);
+	QUADSPI->PSMAR = SR_ALL(match);
+	QUADSPI->PIR   = interval;
+	QUADSPI->DLR   = QSPI_CHIPS - 1;	// one status byte per part, the match needs all of them
 
-	// Start the transfer by re-writing the address in AR register
-	QUADSPI->AR = addr_reg;
+	/* AND match mode, stop as soon as the status matches */
+	QUADSPI->CR = (QUADSPI->CR & ~QUADSPI_CR_PMM) | QUADSPI_CR_APMS;
 
-	while (length)
+	/* No address phase, so writing CCR starts the polling */
+	QUADSPI->CCR = INSTR_LINES | DATA_LINES | READ_STATUS_REG_CMD | QUADSPI_CCR_FMODE_1;
+
+	ms = ms * 1000 / step_us;
+
+	while ((QUADSPI->SR & QSPI_FLAG_SM) == 0)
 	{
-		if (wait_flag((QSPI_FLAG_FT | QSPI_FLAG_TC), SET, 1000) != 0)
+		usleep(step_us);
+		if (--ms == 0)	// if timeout, stop the polling
 		{
-			return -1;
+			QUADSPI->CR |= QUADSPI_CR_ABORT;
+			while (QUADSPI->CR & QUADSPI_CR_ABORT)
+			{
+				if (--n == 0)
+					return 1;
+			}
+			QUADSPI->FCR = QSPI_FLAG_TC | QSPI_FLAG_SM;
+			return 1;
 		}
-		*pdata++ = *(__IO uint8_t *)data_reg;
-		length--;
 	}
 
-	if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
-		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
-	else
-	{
-		return -1;
-	}
+	QUADSPI->FCR = QSPI_FLAG_TC | QSPI_FLAG_SM;	// clear flags
 
-	return buffer[0];
+	return 0;
 }
 
 static int wait_busy_clear(uint32_t timeout)
 {
-	timeout *= 100;
-	int n;
-	while (1)
+	// chip erase runs for tens of seconds, poll it slowly
+	if (timeout > FLASH_DEV_SECTOR_ERASE_MAX_TIME)
+		return auto_poll(FLASH_DEV_SR_BUSY, 0, QSPI_POLL_INTERVAL_LONG, 100, timeout);
+
+	return auto_poll(FLASH_DEV_SR_BUSY, 0, QSPI_POLL_INTERVAL, 1, timeout);
+}
+
+//
+// point the controller at the part holding address, and make address
+// relative to that part. An erase still running on it is waited for, the
+// other part is left to finish its own in the background.
+//
+static int select_bank(uint32_t *address)
+{
+#if QSPI_DUAL_BANK
+	uint32_t b = *address / QSPI_BANK_SIZE;
+	uint32_t timeout;
+
+	*address %= QSPI_BANK_SIZE;
+
+	if (b != ((QUADSPI->CR & QUADSPI_CR_FSEL) ? 1 : 0))
 	{
-		if ((n = read_status_register()) == -1)
+		// the part being left must not stay in continuous read
+		if (continuous_exit() != 0)
 			return 1;
-		if ((n & FLASH_DEV_SR_BUSY) == 0)
-			break;
-		usleep(10);
-		if (--timeout == 0)
+
+		if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+			return 1;
+
+		QUADSPI->CR = (QUADSPI->CR & ~QUADSPI_CR_FSEL) | (b ? QSPI_FLASH_ID_2 : QSPI_FLASH_ID_1);
+	}
+
+	if (pending[b])
+	{
+		timeout = pending[b];
+		pending[b] = 0;
+		return wait_busy_clear(timeout);
+	}
+#endif
+
+	return 0;
+}
+
+//
+// wait for the erase just started on the selected part. With two parts
+// the wait is put off until that part is selected again.
+//
+static int erase_wait(uint32_t timeout)
+{
+#if QSPI_DUAL_BANK
+	pending[(QUADSPI->CR & QUADSPI_CR_FSEL) ? 1 : 0] = timeout;
+	return 0;
+#else
+	return wait_busy_clear(timeout);
+#endif
+}
+
+//
+// wait for an erase put off on the part holding address.
+//
+int flash_wait(uint32_t address)
+{
+	return select_bank(&address);
+}
+
+//
+// wait until every part is idle.
+//
+int flash_sync(void)
+{
+	uint32_t b, address;
+
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0)
 			return 1;
 	}
+
 	return 0;
 }
 
@@ -142,28 +550,85 @@ static int wait_busy_clear(uint32_t timeout)
   */
 static uint8_t write_enable(void /*QSPI_HandleTypeDef *hqspi*/)
 {
-	int n;
-	uint32_t timeout = 100000;
-
 	// send command
 	if (send_single_command(WRITE_ENABLE_CMD) != 0)
 		return 1;
 
 	// now wait for the WEL bit to be set
-	while ((n = read_status_register()) != -1)
+	if (auto_poll(FLASH_DEV_SR_WEL, FLASH_DEV_SR_WEL, QSPI_POLL_INTERVAL, 1, 1000) != 0)
+		return 1;
+
+	return 0;
+}
+
+
+
+
+#if QSPI_QPI_MODE
+//
+// switch the flash to QPI mode, every later phase runs on 4 lines.
+// Read parameters are set for 6 clocks between address and data on 0xEB,
+// the mode byte plus 4 dummy clocks, the same timing as 1-4-4 mode.
+//
+static int qpi_enter(void)
+{
+	uint8_t param[QSPI_CHIPS];
+	uint32_t b, address;
+	int i;
+
+	for (i = 0; i < QSPI_CHIPS; i++)
+		param[i] = QPI_READ_PARAM_6_CLOCKS;
+
+	// every part is switched while the commands still go out in SPI mode
+	for (b = 0; b < QSPI_BANKS; b++)
 	{
-		if (n & FLASH_DEV_SR_WEL)
-			return 0;
-		usleep(10);
-		if (--timeout == 0)
-		{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0 || send_single_command(ENTER_QPI_CMD) != 0)
 			return 1;
-		}
 	}
+	qpi = 1;
 
-	return 1;
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0)
+			return 1;
+
+		QUADSPI->DLR = QSPI_CHIPS - 1;
+		QUADSPI->CCR = INSTR_LINES | DATA_LINES | SET_READ_PARAM_CMD;
+
+		if (write_fifo(param, QSPI_CHIPS) != 0)
+			return 1;
+
+		if (spin_flag(QSPI_FLAG_TC) != 0)
+			return 1;
+		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
+	}
+
+	return 0;
 }
+#endif
+
+//
+// back to standard SPI mode.
+// Sent on 4 lines unconditionally, a chip already in SPI mode only sees two
+// clocks on IO0 and ignores it. If the command fails the line mode is left
+// as it was.
+//
+static int qpi_exit(void)
+{
+	int was_qpi = qpi;
+
+	qpi = 1;
+	if (send_single_command(EXIT_QPI_CMD) != 0)
+	{
+		qpi = was_qpi;
+		return 1;
+	}
+	qpi = 0;
 
+	return 0;
+}
 
 
 
@@ -174,6 +639,12 @@ static uint8_t write_enable(void /*QSPI_HandleTypeDef *hqspi*/)
   */
 static uint8_t reset_memory(void)
 {
+	// reset commands and the status polling after them are issued in SPI mode
+	if (qpi_exit() != 0)
+	{
+		return 1;
+	}
+
 	// send command
 	if (send_single_command(RESET_ENABLE_CMD) != 0)
 	{
@@ -195,12 +666,265 @@ static uint8_t reset_memory(void)
 }
 
 
-/********************************************************************************************/
-/********************************************************************************************/
-/********************************************************************************************/
-
+#if QSPI_CALIBRATE
+//
+// read the 3 byte JEDEC ID, exercises the single line receive path.
+// In dual-flash mode the bytes of both parts come interleaved, and they
+// must agree.
+//
+static int read_jedec_id(uint32_t *id)
+{
+	uint8_t b[3 * QSPI_CHIPS];
+	int i;
+
+	if (continuous_exit() != 0)
+		return 1;
+
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
+
+    QUADSPI->DLR = sizeof(b) - 1;
+    QUADSPI->CCR = QSPI_INSTRUCTION_1_LINE | QSPI_DATA_1_LINE | READ_JEDEC_ID | QUADSPI_CCR_FMODE_0;
+
+	if (read_fifo(b, sizeof(b)) != 0)
+		return 1;
+
+	if (spin_flag(QSPI_FLAG_TC) != 0)
+		return 1;
+	QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
+
+	for (i = 1; i < QSPI_CHIPS; i++)
+	{
+		if (b[i] != b[0] || b[QSPI_CHIPS + i] != b[QSPI_CHIPS] || b[2 * QSPI_CHIPS + i] != b[2 * QSPI_CHIPS])
+			return 1;
+	}
+
+	*id = (b[0] << 16) | (b[QSPI_CHIPS] << 8) | b[2 * QSPI_CHIPS];
+
+	return 0;
+}
+
+//
+// set the output speed of every QSPI pin.
+//
+static void set_pin_speed(uint32_t speed)
+{
+	static GPIO_TypeDef * const port[] = {
+		QSPI_CLK_GPIO_PORT,
+		QSPI_BK1_CS_GPIO_PORT, QSPI_BK1_D0_GPIO_PORT, QSPI_BK1_D1_GPIO_PORT, QSPI_BK1_D2_GPIO_PORT, QSPI_BK1_D3_GPIO_PORT,
+		QSPI_BK2_CS_GPIO_PORT, QSPI_BK2_D0_GPIO_PORT, QSPI_BK2_D1_GPIO_PORT, QSPI_BK2_D2_GPIO_PORT, QSPI_BK2_D3_GPIO_PORT
+	};
+	static const uint16_t pin[] = {
+		QSPI_CLK_PIN,
+		QSPI_BK1_CS_PIN, QSPI_BK1_D0_PIN, QSPI_BK1_D1_PIN, QSPI_BK1_D2_PIN, QSPI_BK1_D3_PIN,
+		QSPI_BK2_CS_PIN, QSPI_BK2_D0_PIN, QSPI_BK2_D1_PIN, QSPI_BK2_D2_PIN, QSPI_BK2_D3_PIN
+	};
+	uint32_t i, pos;
+
+	for (i = 0; i < sizeof(pin) / sizeof(pin[0]); i++)
+	{
+		pos = POSITION_VAL(pin[i]) * 2;
+		port[i]->OSPEEDR = (port[i]->OSPEEDR & ~(3U << pos)) | (speed << pos);
+	}
+}
+
+//
+// switch the bus to a prescaler, sample shift and pin speed.
+// A mapped read (mirror mode reads that way) keeps BUSY set until aborted.
+//
+static int set_timing(uint32_t prescaler, uint32_t sshift, uint32_t speed)
+{
+	if (indirect_mode() != 0)
+		return 1;
+
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
+
+	QUADSPI->CR = (QUADSPI->CR & ~(QUADSPI_CR_PRESCALER | QUADSPI_CR_SSHIFT)) |
+			(prescaler << QUADSPI_CR_PRESCALER_Pos) | sshift;
+	set_pin_speed(speed);
+
+	return 0;
+}
+
+//
+// read the JEDEC ID and the calibration area of every part.
+//
+static int calib_read(uint32_t *id, uint32_t *data)
+{
+	uint32_t b, address;
+
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0 || read_jedec_id(&id[b]) != 0)
+			return 1;
+
+		if (flash_read(b * QSPI_BANK_SIZE + QSPI_CALIB_ADDR, (uint8_t *)(data + b * QSPI_CALIB_SIZE / 4), QSPI_CALIB_SIZE) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+//
+// the reference data only tests the quad lines if every bit of every byte
+// lane is seen both set and clear, so each data line of each part toggles.
+// Blank flash would match at any setting.
+//
+static int calib_data_ok(const uint32_t *data)
+{
+	uint32_t b, i, all_or, all_and;
+
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		all_or = 0;
+		all_and = 0xFFFFFFFF;
+		for (i = 0; i < QSPI_CALIB_SIZE / 4; i++)
+		{
+			all_or |= data[i];
+			all_and &= data[i];
+		}
+		if (all_or != 0xFFFFFFFF || all_and != 0)
+			return 0;
+		data += QSPI_CALIB_SIZE / 4;
+	}
+
+	return 1;
+}
+
+//
+// check a setting against the reference IDs and data, all passes must match.
+//
+static int timing_ok(uint32_t prescaler, uint32_t sshift, uint32_t speed, const uint32_t *ref_id)
+{
+	const uint32_t *ref = stream_buffer[0];
+	uint32_t *buf = stream_buffer[1];
+	uint32_t id[QSPI_BANKS];
+	uint32_t b, i, pass;
+
+	if (set_timing(prescaler, sshift, speed) != 0)
+		return 0;
+
+	for (pass = 0; pass < QSPI_CALIB_PASSES; pass++)
+	{
+		if (calib_read(id, buf) != 0)
+			return 0;
+
+		for (b = 0; b < QSPI_BANKS; b++)
+		{
+			if (id[b] != ref_id[b])
+				return 0;
+		}
+
+		for (i = 0; i < QSPI_BANKS * QSPI_CALIB_SIZE / 4; i++)
+		{
+			if (buf[i] != ref[i])
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+//
+// find the fastest bus setting that reads back reliably.
+// The JEDEC ID and a block of flash are read at QSPI_CALIB_REF_CLOCK as the
+// reference, then every prescaler from the device limit down is tried. A
+// prescaler is taken only when it reads correctly with the sample point both
+// on the edge and shifted by half a cycle, which leaves at least half a clock
+// of data valid window as margin; the session then runs with the half cycle
+// shift. The slower pin speed is preferred when both pass.
+// With two banks a setting has to work for both parts.
+// If the device doesn't answer or the calibration area holds uniform data,
+// like a blank part, nothing can be measured and the bus goes back to the
+// fixed QSPI_PRESCALER setting of flash_init. If the reference reads fine but
+// no faster setting passes, the bus stays at the reference clock.
+//
+static int calib_sweep(void)
+{
+	static const uint32_t speed[] = { GPIO_SPEED_FREQ_HIGH, GPIO_SPEED_FREQ_VERY_HIGH };
+	uint32_t hclk = HAL_RCC_GetHCLKFreq();
+	uint32_t ref_prescaler = (hclk - 1) / QSPI_CALIB_REF_CLOCK;
+	uint32_t prescaler = (hclk - 1) / FLASH_DEV_MAX_CLOCK;
+	uint32_t id[QSPI_BANKS];
+	uint32_t b, i;
+
+	if (ref_prescaler > 255)
+		ref_prescaler = 255;
+
+	if (set_timing(ref_prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, GPIO_SPEED_FREQ_VERY_HIGH) != 0)
+		return 1;
+
+	if (calib_read(id, stream_buffer[0]) != 0)
+		return 1;
+
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		if (id[b] == 0 || id[b] == 0xFFFFFF)
+			return 1;
+	}
+
+	if (!calib_data_ok(stream_buffer[0]))
+		return 1;
+
+	for (; prescaler < ref_prescaler; prescaler++)
+	{
+		for (i = 0; i < sizeof(speed) / sizeof(speed[0]); i++)
+		{
+			if (timing_ok(prescaler, QSPI_SAMPLE_SHIFTING_NONE, speed[i], id) &&
+				timing_ok(prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, speed[i], id))
+			{
+				return set_timing(prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, speed[i]);
+			}
+		}
+	}
+
+	return set_timing(ref_prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, GPIO_SPEED_FREQ_VERY_HIGH);
+}
+
+//
+// calibrate the bus, or fall back to the fixed baseline timing of flash_init
+// (QSPI_PRESCALER, half cycle shift) when nothing could be measured.
+//
+static void calibrate(void)
+{
+	if (calib_sweep() != 0)
+		set_timing(QSPI_PRESCALER, QSPI_SAMPLE_SHIFTING_HALFCYCLE, GPIO_SPEED_FREQ_VERY_HIGH);
+}
+#endif
+
+
+/********************************************************************************************/
+/********************************************************************************************/
+/********************************************************************************************/
+
 static void flash_deinit(void)
 {
+	uint32_t b, address;
+	int in_qpi = qpi;
+
+	/* Leave the flash in SPI mode and out of continuous read, if this session changed either */
+	if (__HAL_RCC_QSPI_IS_CLK_ENABLED() && (QUADSPI->CR & QUADSPI_CR_EN))
+	{
+#if QSPI_DUAL_BANK
+		// an erase of the last session may still run, the reset in flash_init would cut it short
+		for (b = 0; b < QSPI_BANKS; b++)
+			pending[b] = FLASH_DEV_BULK_ERASE_MAX_TIME;
+#endif
+
+		for (b = 0; b < QSPI_BANKS; b++)
+		{
+			address = b * QSPI_BANK_SIZE;
+			select_bank(&address);
+
+			if (in_qpi)
+				qpi_exit();
+			else
+				continuous_exit();
+		}
+	}
+
   /* De-Configure QSPI pins */
 	HAL_GPIO_DeInit(QSPI_CLK_GPIO_PORT, QSPI_CLK_PIN);
 
@@ -222,6 +946,15 @@ static void flash_deinit(void)
 
 	/* Disable the QuadSPI memory interface clock */
 	QSPI_CLK_DISABLE();
+
+	// .bss is not cleared by the programming tool, so (re)set state here
+	memmapped = 0;
+	qpi = 0;
+	continuous = 0;
+#if QSPI_DUAL_BANK
+	for (b = 0; b < QSPI_BANKS; b++)
+		pending[b] = 0;
+#endif
 }
 
 
@@ -229,12 +962,16 @@ static void flash_deinit(void)
 int flash_init(void)
 {
 	GPIO_InitTypeDef gpio_init_structure;
+	uint32_t b, address;
 
 	flash_deinit();
 
 	/* Enable the QuadSPI memory interface clock */
 	QSPI_CLK_ENABLE();
 
+	/* Enable the DMA controller serving the QuadSPI */
+	QSPI_DMA_CLK_ENABLE();
+
 	/* Enable GPIO clocks */
 	QSPI_CS_GPIO_CLK_ENABLE();
 	QSPI_CLK_GPIO_CLK_ENABLE();
@@ -258,149 +995,566 @@ int flash_init(void)
 	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
 	HAL_GPIO_Init(QSPI_BK1_CS_GPIO_PORT, &gpio_init_structure);
 
-	/* QSPI D0 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK1_D0_PIN;
-	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK1_D0_GPIO_PORT, &gpio_init_structure);
+	/* QSPI D0 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK1_D0_PIN;
+	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK1_D0_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D1 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK1_D1_PIN;
+	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK1_D1_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D2 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK1_D2_PIN;
+	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK1_D2_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D3 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK1_D3_PIN;
+	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK1_D3_GPIO_PORT, &gpio_init_structure);
+#endif
+
+	// Bank 2
+
+#if 1
+	/* QSPI CS GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK2_CS_PIN;
+	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK2_CS_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D0 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK2_D0_PIN;
+	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK2_D0_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D1 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK2_D1_PIN;
+	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK2_D1_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D2 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK2_D2_PIN;
+	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK2_D2_GPIO_PORT, &gpio_init_structure);
+
+	/* QSPI D3 GPIO pin configuration  */
+	gpio_init_structure.Pin = QSPI_BK2_D3_PIN;
+	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
+	HAL_GPIO_Init(QSPI_BK2_D3_GPIO_PORT, &gpio_init_structure);
+#endif
+
+	/* Configure QSPI FIFO Threshold */
+	QUADSPI->CR &= ~QUADSPI_CR_FTHRES;
+	QUADSPI->CR |= ((QSPI_FIFO_THRESHOLD - 1) << QUADSPI_CR_FTHRES_Pos);
+
+	// wait for not busy
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000))
+		return 1;
+
+	/* Configure QSPI Clock Prescaler and Sample Shift */
+	QUADSPI->CR &= ~(QUADSPI_CR_PRESCALER | QUADSPI_CR_SSHIFT | QUADSPI_CR_FSEL
+			| QUADSPI_CR_DFM);
+	QUADSPI->CR |= ((QSPI_PRESCALER << QUADSPI_CR_PRESCALER_Pos) |
+			QSPI_SAMPLE_SHIFTING_HALFCYCLE |
+			QSPI_FLASH_ID_1 |
+#if QSPI_CHIPS > 1
+			QSPI_DUALFLASH_ENABLE);
+#else
+			QSPI_DUALFLASH_DISABLE);
+#endif
+
+	/* Configure QSPI Flash Size, CS High Time and Clock Mode */
+	QUADSPI->DCR &=
+			~(QUADSPI_DCR_FSIZE | QUADSPI_DCR_CSHT | QUADSPI_DCR_CKMODE);
+	QUADSPI->DCR |= (((POSITION_VAL(FLASH_DEV_FLASH_SIZE * QSPI_CHIPS) - 1) << 16) |
+	QSPI_CS_HIGH_TIME_6_CYCLE |
+	QSPI_CLOCK_MODE_0);
+
+	/* Enable the QSPI peripheral */
+	QUADSPI->CR |= QUADSPI_CR_EN;
+
+	// an earlier session may have left a part in continuous read, reset the mode bits first
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0)
+			return QSPI_ERROR;
+		continuous = 1;
+		if (reset_memory() != 0)
+			return QSPI_ERROR;
+	}
+
+#if QSPI_CALIBRATE
+	calibrate();
+#endif
+
+#if QSPI_QPI_MODE
+	if (qpi_enter() != 0)
+	{
+		qpi_exit();
+		return QSPI_ERROR;
+	}
+#endif
+
+	return QSPI_OK;
+}
+
+
+
+int flash_chiperase(void)
+{
+	uint32_t b, address;
+
+	// one bulk erase per part, they run at the same time
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		address = b * QSPI_BANK_SIZE;
+		if (select_bank(&address) != 0)
+			return 1;
+
+		if (write_enable() != 0)
+			return 1;
+
+		if (send_single_command(BULK_ERASE_CMD) != 0)
+			return 2;
+
+		if (erase_wait(FLASH_DEV_BULK_ERASE_MAX_TIME))
+			return 3;
+	}
+
+	if (flash_sync() != 0)
+		return 3;
+
+	return 0;
+}
+
+
+
+//
+// set up an indirect quad read of Size bytes at ReadAddr.
+// The AR write starts the transfer.
+//
+static int start_quad_read(uint32_t ReadAddr, uint32_t Size)
+{
+	if (select_bank(&ReadAddr) != 0)
+		return 1;
+
+	if (indirect_mode() != 0)
+		return 1;
+
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
+
+    /* Configure QSPI: DLR register with the number of data to read or write */
+    QUADSPI->DLR = (Size - 1);
+
+    /* Configure QSPI: ABR register with the mode bits, the device stays in continuous read */
+    QUADSPI->ABR = CONTINUOUS_READ_MODE;
+
+    /*---- Command with address and alternate bytes, the instruction only the first time ----*/
+    /* Configure QSPI: CCR register with all communications parameters */
+    QUADSPI->CCR = QSPI_QUAD_READ_CCR | QUADSPI_CCR_FMODE_0;
+
+    /* Configure QSPI: AR register with address value, this starts the transfer */
+    QUADSPI->AR = ReadAddr;
+    continuous = 1;
+
+	return 0;
+}
+
+
+
+int flash_read( uint32_t ReadAddr, uint8_t *pData, uint32_t Size)
+{
+	if (Size == 0)
+		return 0;
+
+#if QSPI_CHIPS > 1
+	// indirect transfers cover whole byte pairs, odd edges and mirrored data go through the mapped window
+	if (QSPI_MIRROR || ((ReadAddr | Size) & 1))
+		return flash_read_mapped(ReadAddr, pData, Size);
+#endif
+
+	// one transfer per part
+	if (flash_span(ReadAddr, Size) < Size)
+	{
+		uint32_t n = flash_span(ReadAddr, Size);
+
+		if (flash_read(ReadAddr, pData, n) != 0)
+			return 1;
+		return flash_read(ReadAddr + n, pData + n, Size - n);
+	}
+
+	if (start_quad_read(ReadAddr, Size) != 0)
+		return 1;
+
+	if (read_fifo(pData, Size) != 0)
+		return 1;
+
+	if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
+		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
+	else
+	{
+		return 2;
+	}
+
+	return 0;
+}
+
+
+
+int flash_read_dma_start( uint32_t ReadAddr, uint32_t *pData, uint32_t Size)
+{
+	if (start_quad_read(ReadAddr, Size) != 0)
+		return 1;
+
+	dma_start(DMA_PERIPH_TO_MEMORY, pData, Size >> 2);
+
+	return 0;
+}
+
+
+
+int flash_read_dma_wait(void)
+{
+	if (dma_wait(1000) != 0)
+		return 2;
+
+	if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
+		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
+	else
+	{
+		return 2;
+	}
+
+	return 0;
+}
+
+
+
+int flash_stream( uint32_t address, uint32_t length, flash_sink_t sink, void *ctx)
+{
+	uint32_t body, chunk, next, tail;
+	int buf = 0;
+
+	/*
+	 * The DMA lands in word aligned buffers whatever the flash alignment,
+	 * so only the 0..3 bytes past the last whole word need separate care.
+	 */
+	body = length & ~3;
+	tail = length & 3;
+
+	/*
+	 * Indirect transfers start on a byte pair in dual-flash mode and stay
+	 * within one part with two banks, other ranges and mirrored data are
+	 * copied from the mapped window.
+	 */
+	if (QSPI_MIRROR || ((address & 1) && QSPI_DUAL_FLASH) || flash_span(address, length) < length)
+	{
+		while (length)
+		{
+			chunk = (length > QSPI_STREAM_CHUNK) ? QSPI_STREAM_CHUNK : length;
+			stream_buffer[0][(chunk - 1) >> 2] = 0;
+			if (flash_read_mapped(address, (uint8_t *)stream_buffer[0], chunk) != 0)
+				return 1;
+			sink(stream_buffer[0], chunk, ctx);
+
+			address += chunk;
+			length -= chunk;
+		}
+		return 0;
+	}
+
+	chunk = (body > QSPI_STREAM_CHUNK) ? QSPI_STREAM_CHUNK : body;
+	if (chunk && flash_read_dma_start(address, stream_buffer[buf], chunk) != 0)
+		return 1;
+
+	while (chunk)
+	{
+		if (flash_read_dma_wait() != 0)
+			return 2;
+
+		address += chunk;
+		body -= chunk;
+
+		next = (body > QSPI_STREAM_CHUNK) ? QSPI_STREAM_CHUNK : body;
+		if (next && flash_read_dma_start(address, stream_buffer[buf ^ 1], next) != 0)
+			return 1;
+
+		sink(stream_buffer[buf], chunk, ctx);
+
+		buf ^= 1;
+		chunk = next;
+	}
+
+	// tail, in a zero padded word
+	if (tail)
+	{
+		stream_buffer[buf][0] = 0;
+		if (flash_read(address, (uint8_t *)stream_buffer[buf], tail) != 0)
+			return 1;
+		sink(stream_buffer[buf], tail, ctx);
+	}
+
+	return 0;
+}
+
+
+
+const uint8_t *flash_map(uint32_t address)
+{
+	if (select_bank(&address) != 0 || flash_memmap_enable() != 0)
+		return NULL;
+
+	return (const uint8_t *)(FLASH_MAPPED_BASE + QSPI_ADDR(address));
+}
 
-	/* QSPI D1 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK1_D1_PIN;
-	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK1_D1_GPIO_PORT, &gpio_init_structure);
 
-	/* QSPI D2 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK1_D2_PIN;
-	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK1_D2_GPIO_PORT, &gpio_init_structure);
 
-	/* QSPI D3 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK1_D3_PIN;
-	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK1_D3_GPIO_PORT, &gpio_init_structure);
+uint32_t flash_span(uint32_t address, uint32_t length)
+{
+#if QSPI_DUAL_BANK
+	uint32_t left = QSPI_BANK_SIZE - address % QSPI_BANK_SIZE;
+
+	if (length > left)
+		return left;
 #endif
 
-	// Bank 2
+	return length;
+}
 
-#if 1
-	/* QSPI CS GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK2_CS_PIN;
-	gpio_init_structure.Alternate = GPIO_AF9_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK2_CS_GPIO_PORT, &gpio_init_structure);
 
-	/* QSPI D0 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK2_D0_PIN;
-	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK2_D0_GPIO_PORT, &gpio_init_structure);
 
-	/* QSPI D1 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK2_D1_PIN;
-	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK2_D1_GPIO_PORT, &gpio_init_structure);
+int flash_memmap_enable(void)
+{
+	if (memmapped)
+		return 0;
 
-	/* QSPI D2 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK2_D2_PIN;
-	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK2_D2_GPIO_PORT, &gpio_init_structure);
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
 
-	/* QSPI D3 GPIO pin configuration  */
-	gpio_init_structure.Pin = QSPI_BK2_D3_PIN;
-	gpio_init_structure.Alternate = GPIO_AF10_QUADSPI;
-	HAL_GPIO_Init(QSPI_BK2_D3_GPIO_PORT, &gpio_init_structure);
-#endif
+	/* No timeout counter, nCS stays low while the prefetch waits for the next access */
+	QUADSPI->CR &= ~QUADSPI_CR_TCEN;
 
-	/* Configure QSPI FIFO Threshold */
-	QUADSPI->CR &= QUADSPI_CR_FTHRES;
-	QUADSPI->CR |= (3 << 8);			// set FIFO Threshold to 4
+	/* Mode bits keep the device in continuous read, SIOO drops the opcode after the first access */
+    QUADSPI->ABR = CONTINUOUS_READ_MODE;
+    QUADSPI->CCR = QSPI_QUAD_READ_CCR | QUADSPI_CCR_SIOO | QUADSPI_CCR_FMODE;
 
-	// wait for not busy
-	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000))
-		return 1;
+	memmapped = 1;
+	continuous = 1;
 
-	/* Configure QSPI Clock Prescaler and Sample Shift */
-	QUADSPI->CR &= ~(QUADSPI_CR_PRESCALER | QUADSPI_CR_SSHIFT | QUADSPI_CR_FSEL
-			| QUADSPI_CR_DFM);
-	QUADSPI->CR |= ((2 << 24) |	// set clock prescaler to 2 => 72MHz
-			QSPI_SAMPLE_SHIFTING_HALFCYCLE |
-			QSPI_FLASH_ID_1 |
-			QSPI_DUALFLASH_DISABLE);
+	return 0;
+}
 
-	/* Configure QSPI Flash Size, CS High Time and Clock Mode */
-	QUADSPI->DCR &=
-			~(QUADSPI_DCR_FSIZE | QUADSPI_DCR_CSHT | QUADSPI_DCR_CKMODE);
-	QUADSPI->DCR |= (((POSITION_VAL(FLASH_DEV_FLASH_SIZE) - 1) << 16) |
-	QSPI_CS_HIGH_TIME_6_CYCLE |
-	QSPI_CLOCK_MODE_0);
 
-	/* Enable the QSPI peripheral */
-	QUADSPI->CR |= QUADSPI_CR_EN;
 
-	reset_memory();
+//
+// copy Size bytes from the mapped window at src
+//
+static int copy_mapped(uint8_t *pData, const uint8_t *src, uint32_t Size)
+{
+	uint32_t chunk, width;
 
-	return QSPI_OK;
+	if (Size >= QSPI_DMA_MIN_SIZE)
+	{
+		// word transfers need source and destination at the same alignment
+		width = 1;
+		if ((((uint32_t)src ^ (uint32_t)pData) & 3) == 0)
+		{
+			while ((uint32_t)src & 3)
+			{
+				*pData++ = *src++;
+				Size--;
+			}
+			width = 4;
+		}
+
+		while (Size >= width)
+		{
+			chunk = Size & ~(width - 1);
+			if (chunk > 0xFFFF * width)
+				chunk = 0xFFFF * width;
+
+			dma_copy(pData, src, chunk, width);
+			if (dma_wait(1000) != 0)
+				return 2;
+
+			src += chunk;
+			pData += chunk;
+			Size -= chunk;
+		}
+	}
+
+	while (Size--)
+		*pData++ = *src++;
+
+	return 0;
 }
 
 
 
-int flash_chiperase(void)
+int flash_read_mapped( uint32_t ReadAddr, uint8_t *pData, uint32_t Size)
 {
-	if (write_enable() != 0)
-		return 1;
+	const uint8_t *src;
+	uint32_t n;
+#if QSPI_MIRROR
+	uint32_t i;
+#endif
 
-	if (send_single_command(BULK_ERASE_CMD) != 0)
-		return 2;
+	while (Size)
+	{
+		n = flash_span(ReadAddr, Size);
+		if ((src = flash_map(ReadAddr)) == NULL)
+			return 1;
 
-	if (wait_busy_clear(FLASH_DEV_BULK_ERASE_MAX_TIME))
-		return 3;
+#if QSPI_MIRROR
+		// the BK1 copy of every byte
+		for (i = 0; i < n; i++)
+			pData[i] = src[i * QSPI_CHIPS];
+#else
+		if (copy_mapped(pData, src, n) != 0)
+			return 2;
+#endif
+
+		ReadAddr += n;
+		pData += n;
+		Size -= n;
+	}
 
 	return 0;
 }
 
 
 
-int flash_read( uint32_t ReadAddr, uint8_t *pData, uint32_t Size)
+//
+// number of leading bytes of p[0..n-1] equal to the erase value
+//
+static uint32_t blank_head(const uint8_t *p, uint32_t n)
 {
-	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+	const uint8_t *start = p;
+	const uint8_t *end = p + n;
+
+	while (p < end && ((uint32_t)p & 3))
+	{
+		if (*p != FLASH_DEV_ERASE_VALUE)
+			return p - start;
+		p++;
+	}
+	while (p + 4 <= end && *(const uint32_t *)p == ERASED_WORD)
+		p += 4;
+	while (p < end && *p == FLASH_DEV_ERASE_VALUE)
+		p++;
+
+	return p - start;
+}
+
+//
+// number of trailing bytes of p[0..n-1] equal to the erase value
+//
+static uint32_t blank_tail(const uint8_t *p, uint32_t n)
+{
+	const uint8_t *end = p + n;
+	const uint8_t *q = end;
+
+	while (q > p && ((uint32_t)q & 3))
+	{
+		if (q[-1] != FLASH_DEV_ERASE_VALUE)
+			return end - q;
+		q--;
+	}
+	while (q >= p + 4 && *(const uint32_t *)(q - 4) == ERASED_WORD)
+		q -= 4;
+	while (q > p && q[-1] == FLASH_DEV_ERASE_VALUE)
+		q--;
+
+	return end - q;
+}
+
+//
+// program Size bytes (within one page) at address
+//
+static int program_page(uint32_t address, const uint8_t *pData, uint32_t Size)
+{
+#if QSPI_DUAL_FLASH
+	uint32_t i, pad;
+
+	// both parts take one byte of every pair, odd edges are padded with the erase value.
+	// An odd start with a span ending on the page boundary fills pad_buffer exactly,
+	// the trailing pad byte only exists when the end is odd.
+	if ((address | Size) & 1)
+	{
+		pad = address & 1;
+		pad_buffer[0] = FLASH_DEV_ERASE_VALUE;
+		for (i = 0; i < Size; i++)
+			pad_buffer[pad + i] = pData[i];
+		if ((pad + Size) & 1)
+			pad_buffer[pad + Size] = FLASH_DEV_ERASE_VALUE;
+
+		address -= pad;
+		Size = (Size + pad + 1) & ~1;
+		pData = pad_buffer;
+	}
+#elif QSPI_MIRROR
+	uint32_t i;
+
+	// every byte goes to both parts, side by side
+	for (i = 0; i < Size; i++)
+	{
+		pad_buffer[2 * i] = pData[i];
+		pad_buffer[2 * i + 1] = pData[i];
+	}
+
+	address = QSPI_ADDR(address);
+	Size *= QSPI_CHIPS;
+	pData = pad_buffer;
+#endif
+
+	if (select_bank(&address) != 0)
+		return 1;
+
+	/* Enable write operations */
+	if (write_enable() != 0)
+	{
 		return 1;
+	}
 
     /* Configure QSPI: DLR register with the number of data to read or write */
-    QUADSPI->DLR = (Size - 1);
+    QUADSPI->DLR =  (Size - 1);
 
     /* Configure QSPI: ABR register with alternate bytes value */
     QUADSPI->ABR = 0;
 
     /*---- Command with instruction, address and alternate bytes ----*/
     /* Configure QSPI: CCR register with all communications parameters */
-    QUADSPI->CCR = (QSPI_DATA_4_LINES | (FLASH_DEV_DUMMY_CYCLES_READ_QUAD << 18) | QSPI_ALTERNATE_BYTES_8_BITS |
-    				QSPI_ALTERNATE_BYTES_4_LINES | QSPI_ADDRESS_24_BITS | QSPI_ADDRESS_4_LINES |
-					QSPI_INSTRUCTION_1_LINE | QUAD_INOUT_FAST_READ_CMD | QUADSPI_CCR_FMODE_0);
+    QUADSPI->CCR = (QSPI_DATA_4_LINES | QSPI_ADDRESS_24_BITS | QSPI_ADDRESS_4_LINES |
+					INSTR_LINES | (qpi ? PAGE_PROG_CMD : QUAD_PAGE_PROG_CMD));
 
     /* Configure QSPI: AR register with address value */
-    QUADSPI->AR = ReadAddr;
-
-
-    volatile uint32_t addr_reg = QUADSPI->AR;
-    __IO uint32_t *data_reg = &QUADSPI->DR;
-
-	// Start the transfer by re-writing the address in AR register
-	QUADSPI->AR = addr_reg;
+    QUADSPI->AR = address;
 
-	while (Size)
+#if QSPI_WRITE_DMA
+	if (write_page_dma(pData, Size) != 0)
+#else
+	if (write_fifo(pData, Size) != 0)
+#endif
 	{
-		if (wait_flag((QSPI_FLAG_FT | QSPI_FLAG_TC), SET, 1000) != 0)
-		{
-			return 1;
-		}
-		*pData++ = *(__IO uint8_t *) data_reg;
-		Size--;
+		return 2;
 	}
 
-	if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
+	if (spin_flag(QSPI_FLAG_TC) == 0)
 		QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
 	else
 	{
 		return 2;
 	}
 
+	if (wait_busy_clear(1000))
+	{
+		return 3;
+	}
+
 	return 0;
 }
 
@@ -409,10 +1563,14 @@ int flash_read( uint32_t ReadAddr, uint8_t *pData, uint32_t Size)
 int flash_write( uint32_t WriteAddr, uint8_t *pData, uint32_t Size)
 {
 	uint32_t end_addr, current_size, current_addr;
-    __IO uint32_t *data_reg = &QUADSPI->DR;
+	uint32_t skip, length;
+	int err;
+
+	if (Size == 0)
+		return 0;
 
 	/* Calculation of the size between the write address and the end of the page */
-	current_size = FLASH_DEV_PAGE_SIZE - (WriteAddr % FLASH_DEV_PAGE_SIZE);
+	current_size = QSPI_MEM_PAGE_SIZE - (WriteAddr % QSPI_MEM_PAGE_SIZE);
 
 	/* Check if the size of the data is less than the remaining place in the page */
 	if (current_size > Size)
@@ -424,58 +1582,34 @@ int flash_write( uint32_t WriteAddr, uint8_t *pData, uint32_t Size)
 	current_addr = WriteAddr;
 	end_addr = WriteAddr + Size;
 
-	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+	if (indirect_mode() != 0)
 		return 1;
 
-
-//	usleep(500);
+	if (wait_flag(QSPI_FLAG_BUSY, RESET, 1000) != 0)
+		return 1;
 
 	/* Perform the write page by page */
 	do
 	{
-		/* Enable write operations */
-		if (write_enable() != 0)
-		{
-			return 1;
-		}
-
-	    /* Configure QSPI: DLR register with the number of data to read or write */
-	    QUADSPI->DLR =  (current_size - 1);
-
-	    /* Configure QSPI: ABR register with alternate bytes value */
-	    QUADSPI->ABR = 0;
-
-	    /*---- Command with instruction, address and alternate bytes ----*/
-	    /* Configure QSPI: CCR register with all communications parameters */
-	    QUADSPI->CCR = (QSPI_DATA_4_LINES | QSPI_ADDRESS_24_BITS | QSPI_ADDRESS_4_LINES |
-						QSPI_INSTRUCTION_1_LINE | QUAD_PAGE_PROG_CMD);
-
-	    /* Configure QSPI: AR register with address value */
-	    QUADSPI->AR = current_addr;
-
-		current_addr += current_size;
-
-		while (current_size > 0)
+		/*
+		 * Programming erase value bytes is a no-op, so blank pages are skipped
+		 * and leading/trailing blank runs are trimmed off the page. Blank runs
+		 * inside a page are still sent, a second program would cost another tPP.
+		 */
+		skip = blank_head(pData, current_size);
+		if (skip < current_size)
 		{
-		  while ((QUADSPI->SR & QSPI_FLAG_FT) == 0);	// wait
+			length = current_size - skip;
+			length -= blank_tail(pData + skip, length);
 
-		  *(__IO uint8_t *)data_reg = *pData++;			// send byte
-		  current_size--;								// decrement size
+			if ((err = program_page(current_addr + skip, pData + skip, length)) != 0)
+				return err;
 		}
 
-		if (wait_flag(QSPI_FLAG_TC, SET, 1000) == 0)
-			QUADSPI->FCR = QSPI_FLAG_TC;	// clear flag
-		else
-		{
-			return 2;
-		}
-
-		if (wait_busy_clear(1000))
-		{
-			return 3;
-		}
+		current_addr += current_size;
+		pData += current_size;
 
-		current_size = ((current_addr + FLASH_DEV_PAGE_SIZE) > end_addr) ? (end_addr - current_addr) : FLASH_DEV_PAGE_SIZE;
+		current_size = ((current_addr + QSPI_MEM_PAGE_SIZE) > end_addr) ? (end_addr - current_addr) : QSPI_MEM_PAGE_SIZE;
 	} while (current_addr < end_addr);
 
 	return 0;
@@ -488,6 +1622,9 @@ int flash_erase(uint32_t address, blocksize_e blocktype)
 	uint8_t cmd;
 	uint32_t erase_time = FLASH_DEV_SUBSECTOR_ERASE_MAX_TIME;
 
+	if (blocktype != BLOCKSIZE_ALL && select_bank(&address) != 0)
+		return 1;
+
 	// Enable write operations
 	if (write_enable() != 0)
 	{
@@ -525,15 +1662,15 @@ int flash_erase(uint32_t address, blocksize_e blocktype)
 
     /*---- Command with instruction and address ----*/
     /* Configure QSPI: CCR register with all communications parameters */
-    QUADSPI->CCR = QSPI_ADDRESS_24_BITS | QSPI_ADDRESS_1_LINE | QSPI_INSTRUCTION_1_LINE | cmd;
+    QUADSPI->CCR = QSPI_ADDRESS_24_BITS | ADDR_LINES | INSTR_LINES | cmd;
 
     /* Configure QSPI: AR register with address value */
-    QUADSPI->AR = address;
+    QUADSPI->AR = QSPI_ADDR(address);
 
     usleep(10);
 
 
-	if (wait_busy_clear(erase_time))
+	if (erase_wait(erase_time))
 	{
 		return 3;
 	}
@@ -549,3 +1686,167 @@ int flash_erase(uint32_t address, blocksize_e blocktype)
 
 
 
+//
+// check length bytes of the mapped window at pbyte against the erase value
+//
+static int blank_mapped(const uint8_t *pbyte, uint32_t length)
+{
+	const uint32_t *p;
+	uint32_t acc;
+
+	// head, up to word alignment
+	while (length && ((uint32_t)pbyte & 3))
+	{
+		if (*pbyte++ != FLASH_DEV_ERASE_VALUE)
+			return 0;
+		length--;
+	}
+
+	// body, eight words per compare. AND keeps a cleared bit of any word,
+	// OR a set one, so the reduction depends on the erase value
+	p = (const uint32_t *)pbyte;
+	while (length >= 32)
+	{
+#if FLASH_DEV_ERASE_VALUE == 0xFF
+		acc = p[0] & p[1] & p[2] & p[3] & p[4] & p[5] & p[6] & p[7];
+#elif FLASH_DEV_ERASE_VALUE == 0x00
+		acc = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+#else
+#error "blank_mapped needs an erase value of 0xFF or 0x00"
+#endif
+		if (acc != ERASED_WORD)
+			return 0;
+		p += 8;
+		length -= 32;
+	}
+	while (length >= 4)
+	{
+		if (*p++ != ERASED_WORD)
+			return 0;
+		length -= 4;
+	}
+
+	// tail
+	pbyte = (const uint8_t *)p;
+	while (length--)
+	{
+		if (*pbyte++ != FLASH_DEV_ERASE_VALUE)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+
+int flash_is_blank(uint32_t address, uint32_t length)
+{
+	const uint8_t *pbyte;
+	uint32_t n;
+
+	while (length)
+	{
+		n = flash_span(address, length);
+		// in mirror mode both copies have to be blank
+		if ((pbyte = flash_map(address)) == NULL || !blank_mapped(pbyte, QSPI_ADDR(n)))
+			return 0;
+
+		address += n;
+		length -= n;
+	}
+
+	return 1;
+}
+
+
+
+//
+// erase the next block of [*address, end), the largest aligned one that
+// fits: 64K, then 32K, then 4K at the edges. Blank blocks are skipped.
+//
+static int erase_block(uint32_t *address, uint32_t end)
+{
+	blocksize_e blocktype;
+	uint32_t blocksize;
+
+	if ((*address % QSPI_MEM_SECTOR_SIZE) == 0 && (end - *address) >= QSPI_MEM_SECTOR_SIZE)
+	{
+		blocktype = BLOCKSIZE_64K;
+		blocksize = QSPI_MEM_SECTOR_SIZE;
+	}
+	else if ((*address % QSPI_MEM_HALFSECTOR_SIZE) == 0 && (end - *address) >= QSPI_MEM_HALFSECTOR_SIZE)
+	{
+		blocktype = BLOCKSIZE_32K;
+		blocksize = QSPI_MEM_HALFSECTOR_SIZE;
+	}
+	else
+	{
+		blocktype = BLOCKSIZE_4K;
+		blocksize = QSPI_MEM_SUBSECTOR_SIZE;
+	}
+
+	// a blank check costs microseconds, an erase milliseconds
+	if (!flash_is_blank(*address, blocksize) && flash_erase(*address, blocktype) != 0)
+		return 1;
+
+	*address += blocksize;
+
+	return 0;
+}
+
+
+
+int flash_erase_range(uint32_t address, uint32_t length)
+{
+	uint32_t end;
+	uint32_t next[QSPI_BANKS], last[QSPI_BANKS];
+	uint32_t b;
+	int more;
+
+	// round out to whole subsectors, clipped to the device
+	end = address + length;
+	address -= address % QSPI_MEM_SUBSECTOR_SIZE;
+	end += (QSPI_MEM_SUBSECTOR_SIZE - end % QSPI_MEM_SUBSECTOR_SIZE) % QSPI_MEM_SUBSECTOR_SIZE;
+	if (end > QSPI_MEM_SIZE)
+		end = QSPI_MEM_SIZE;
+
+	// whole device, one chip erase
+	if (address == 0 && end == QSPI_MEM_SIZE)
+	{
+		if (flash_is_blank(0, QSPI_MEM_SIZE))
+			return 0;
+		if (flash_erase(0, BLOCKSIZE_ALL) != 0)
+			return 1;
+		return flash_sync();
+	}
+
+	/*
+	 * One cursor per part, the parts take turns. With two banks an erase
+	 * started on one part runs on while the next block of the other part is
+	 * checked and started, the wait only comes when a part is selected again.
+	 * The last erase of each part may still run on return, to overlap with
+	 * what the caller does next on the other part; flash_wait or flash_sync
+	 * collects it and reports a late timeout.
+	 */
+	for (b = 0; b < QSPI_BANKS; b++)
+	{
+		next[b] = (address > b * QSPI_BANK_SIZE) ? address : b * QSPI_BANK_SIZE;
+		last[b] = (end < (b + 1) * QSPI_BANK_SIZE) ? end : (b + 1) * QSPI_BANK_SIZE;
+	}
+
+	do
+	{
+		more = 0;
+		for (b = 0; b < QSPI_BANKS; b++)
+		{
+			if (next[b] >= last[b])
+				continue;
+
+			if (erase_block(&next[b], last[b]) != 0)
+				return 1;
+			more = 1;
+		}
+	} while (more);
+
+	return 0;
+}
@@ -13,6 +13,9 @@
 #include <loader_main.h>
 #include <string.h>
 #include "flash.h"
+#include "crc32.h"
+#include "sha256.h"
+#include "lz4.h"
 
 #include "dbg_serial.h"
 #include "printf.h"
@@ -46,7 +49,8 @@ int Init (void)
 
 	dbg_serial_init();
 
-	flash_init();
+	if (flash_init() != QSPI_OK)
+		return 0;
 
 	return 1;
 }
@@ -56,7 +60,7 @@ KeepInCompilation int Read(uint32_t Address, uint32_t Size, uint8_t* buffer)
 {
 	Address &= 0x0FFFFFFF;
 
-	return !flash_read(Address, buffer, Size);
+	return !flash_read_mapped(Address, buffer, Size);
 }
 
 
@@ -77,6 +81,250 @@ KeepInCompilation int Write (uint32_t Address, uint32_t Size, uint8_t* buffer)
 }
 
 
+/* Ring buffer of StreamWrite, filled by the host while the target runs */
+KeepInCompilation struct StreamRing StreamRing;
+
+/**
+  * Description :
+  * Programs Size bytes at StartAddress from StreamRing while the host is
+  * still filling it, so the SWD transfer of one page overlaps the program
+  * time of the previous one. The host sets Head (0, or the number of bytes
+  * already placed) before the call, then keeps writing data and Head in the
+  * background, never more than QSPI_RING_SIZE ahead of Tail.
+  * A page is programmed once all of it is in the ring, a last partial page
+  * once the whole stream is.
+  * Inputs    :
+  *      StartAddress  : Flash start address
+  *      Size          : Size (in BYTES)
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  *     StreamRing     : Status and Tail
+  */
+KeepInCompilation int StreamWrite (uint32_t StartAddress, uint32_t Size)
+{
+  uint32_t done = 0, idle = 0;
+  uint32_t avail, room, n;
+
+  StartAddress &= 0x0FFFFFFF;
+  StreamRing.Tail = 0;
+  StreamRing.Status = 0;
+
+  while (done < Size)
+  {
+    avail = StreamRing.Head - done;
+    __DMB();                    /* data is read only after Head */
+
+    if (avail > Size - done)
+      avail = Size - done;
+    room = QSPI_MEM_PAGE_SIZE - (StartAddress + done) % QSPI_MEM_PAGE_SIZE;
+
+    /* Wait for the rest of the page, unless the stream ends inside it */
+    if (avail < room && avail < Size - done)
+    {
+      if (++idle > QSPI_RING_TIMEOUT * 100)
+      {
+        StreamRing.Status = 3;
+        return 0;
+      }
+      usleep(10);
+      continue;
+    }
+    idle = 0;
+
+    n = (avail < room) ? avail : room;
+    if (flash_write(StartAddress + done, &StreamRing.Data[(StartAddress + done) % QSPI_RING_SIZE], n) != 0)
+    {
+      StreamRing.Status = 2;
+      return 0;
+    }
+
+    done += n;
+    __DMB();
+    StreamRing.Tail = done;
+  }
+
+  StreamRing.Status = 1;
+  return 1;
+}
+
+
+/* Raw data of the LZ4 block being programmed */
+static uint8_t lz4_staging[LZ4_MAX_BLOCK];
+
+/**
+  * Description :
+  * Programs a compressed payload, as made by tools/lz4pack: independent
+  * LZ4 blocks, each behind a header with its compressed and raw size. Every
+  * block is decompressed into RAM and then written like Write does.
+  * Inputs    :
+  *      Address       : Flash address of the first raw byte
+  *      Size          : Size of the compressed payload (in BYTES)
+  *      buffer        : Compressed payload
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  */
+KeepInCompilation int WriteLz4 (uint32_t Address, uint32_t Size, uint8_t* buffer)
+{
+  uint32_t packed, raw;
+
+  Address &= 0x0FFFFFFF;
+
+  while (Size >= LZ4_HEADER_SIZE)
+  {
+    packed = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+    raw = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+    buffer += LZ4_HEADER_SIZE;
+    Size -= LZ4_HEADER_SIZE;
+
+    if (packed > Size || raw > LZ4_MAX_BLOCK)
+      return 0;
+    if (lz4_decompress(buffer, packed, lz4_staging, raw) != (int32_t)raw)
+      return 0;
+    if (flash_write(Address, lz4_staging, raw) != 0)
+      return 0;
+
+    buffer += packed;
+    Size -= packed;
+    Address += raw;
+  }
+
+  /* Trailing bytes that don't make a header are a broken payload */
+  return Size == 0;
+}
+
+
+/* Little-endian fields of the sparse headers, which need not be aligned */
+#define GET16(p)    ((p)[0] | ((p)[1] << 8))
+#define GET32(p)    ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+/* Page of a FILL chunk pattern */
+static uint32_t fill_buffer[QSPI_MEM_PAGE_SIZE / 4];
+
+/*
+ * Program length bytes at Address with a repeated 32-bit pattern
+ */
+static int write_fill(uint32_t Address, uint32_t length, uint32_t pattern)
+{
+  uint32_t i, n;
+
+  for (i = 0; i < QSPI_MEM_PAGE_SIZE / 4; i++)
+    fill_buffer[i] = pattern;
+
+  /* Whole words of the buffer each time, the pattern stays in phase */
+  while (length)
+  {
+    n = (length < sizeof(fill_buffer)) ? length : sizeof(fill_buffer);
+    if (flash_write(Address, (uint8_t *)fill_buffer, n) != 0)
+      return 1;
+    Address += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Walk the chunks of a sparse image at Address. Without program every
+ * header and size is only checked, with it the chunks are written.
+ */
+static int sparse_walk(uint32_t Address, uint32_t Size, const uint8_t *buffer, int program)
+{
+  const uint8_t *chunk;
+  uint32_t file_hdr, chunk_hdr, blk_sz, chunks;
+  uint32_t pos, type, total, length, pattern;
+
+  if (Size < SPARSE_HEADER_SIZE || GET32(buffer) != SPARSE_HEADER_MAGIC || GET16(buffer + 4) != 1)
+    return 0;
+
+  file_hdr = GET16(buffer + 8);
+  chunk_hdr = GET16(buffer + 10);
+  blk_sz = GET32(buffer + 12);
+  chunks = GET32(buffer + 20);
+
+  if (file_hdr < SPARSE_HEADER_SIZE || file_hdr > Size || chunk_hdr < SPARSE_CHUNK_HEADER_SIZE || blk_sz == 0 || (blk_sz & 3))
+    return 0;
+  if (Address > QSPI_MEM_SIZE)
+    return 0;
+
+  for (pos = file_hdr; chunks; chunks--)
+  {
+    if (Size - pos < chunk_hdr)
+      return 0;
+    chunk = buffer + pos;
+    type = GET16(chunk);
+    total = GET32(chunk + 8);
+    if (total < chunk_hdr || total > Size - pos)
+      return 0;
+
+    /* Every chunk has to stay inside the flash */
+    if ((uint64_t)GET32(chunk + 4) * blk_sz > QSPI_MEM_SIZE - Address)
+      return 0;
+    length = GET32(chunk + 4) * blk_sz;
+
+    switch (type)
+    {
+    case SPARSE_CHUNK_RAW:
+      if (total - chunk_hdr != length)
+        return 0;
+      if (program && flash_write(Address, (uint8_t *)chunk + chunk_hdr, length) != 0)
+        return 0;
+      break;
+
+    case SPARSE_CHUNK_FILL:
+      if (total - chunk_hdr < 4)
+        return 0;
+      pattern = GET32(chunk + chunk_hdr);
+
+      /* Erased flash already holds it */
+      if (program && pattern != FLASH_DEV_ERASE_VALUE * 0x01010101U && write_fill(Address, length, pattern) != 0)
+        return 0;
+      break;
+
+    case SPARSE_CHUNK_DONT_CARE:
+      break;
+
+    case SPARSE_CHUNK_CRC32:
+      length = 0;
+      break;
+
+    default:
+      return 0;
+    }
+
+    Address += length;
+    pos += total;
+  }
+
+  return 1;
+}
+
+
+/**
+  * Description :
+  * Programs a sparse image (the Android sparse layout, as made by img2simg)
+  * at Address. RAW chunks are written, FILL chunks are expanded on target,
+  * or skipped when the pattern is the erase value, DONT_CARE chunks leave
+  * the flash as it is. The whole image is checked before anything is
+  * programmed.
+  * Inputs    :
+  *      Address       : Flash address of the first block
+  *      Size          : Size of the sparse image (in BYTES)
+  *      buffer        : Sparse image
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  */
+KeepInCompilation int WriteSparse (uint32_t Address, uint32_t Size, uint8_t* buffer)
+{
+  Address &= 0x0FFFFFFF;
+
+  if (!sparse_walk(Address, Size, buffer, 0))
+    return 0;
+
+  return sparse_walk(Address, Size, buffer, 1);
+}
+
+
 /**
   * @brief   Sector erase.
   * @param   EraseStartAddress :  erase start address
@@ -85,28 +333,71 @@ KeepInCompilation int Write (uint32_t Address, uint32_t Size, uint8_t* buffer)
   */
 KeepInCompilation int SectorErase (uint32_t EraseStartAddress, uint32_t EraseEndAddress)
 {
-  uint32_t BlockAddr;
-
   EraseStartAddress &= 0x0FFFFFFF;
   EraseEndAddress &= 0x0FFFFFFF;
 
-  EraseStartAddress = EraseStartAddress -  EraseStartAddress % QSPI_SECTOR_SIZE;
-	
-  while (EraseEndAddress >= EraseStartAddress)
+  if (EraseEndAddress < EraseStartAddress)
+    return 1;
+
+  /* End address is inclusive, the sector containing it is erased as well */
+  if (flash_erase_range(EraseStartAddress, EraseEndAddress - EraseStartAddress + 1) != 0)
+    return 0;
+
+  /* Success means erased, wait for erases still running on either part */
+  return !flash_sync();
+}
+
+
+/**
+  * @brief   Full chip erase.
+  * @param   Parallelism : not used
+  * @retval  1      : Operation succeeded
+  * @retval  0      : Operation failed
+  */
+KeepInCompilation int MassErase (uint32_t Parallelism)
+{
+  return !flash_chiperase();
+}
+
+
+/*
+ * Add the bytes of 'words' 32-bit words to acc, four byte lanes per
+ * USADA8 (sum of absolute differences against zero).
+ */
+static uint32_t sum_words(const uint32_t *p, uint32_t words, uint32_t acc)
+{
+  while (words >= 4)
   {
-    BlockAddr = EraseStartAddress & 0x0FFFFFFF;
-    if (flash_erase(BlockAddr, BLOCKSIZE_4K) == 1)
-    	return 0;
-    EraseStartAddress += QSPI_SECTOR_SIZE;
+    acc = __USADA8(p[0], 0, acc);
+    acc = __USADA8(p[1], 0, acc);
+    acc = __USADA8(p[2], 0, acc);
+    acc = __USADA8(p[3], 0, acc);
+    p += 4;
+    words -= 4;
   }
-  
-  return 1;	
+  while (words--)
+    acc = __USADA8(*p++, 0, acc);
+
+  return acc;
+}
+
+/*
+ * flash_stream sink for CheckSum, unused byte lanes of a last partial
+ * word are zero and add nothing.
+ */
+static void checksum_sink(const uint32_t *data, uint32_t length, void *ctx)
+{
+  uint32_t *sum = ctx;
+
+  *sum = sum_words(data, (length + 3) >> 2, *sum);
 }
 
 
 /**
   * Description :
-  * Calculates checksum value of the memory zone
+  * Calculates checksum value of the memory zone.
+  * The range is streamed by DMA quad reads into RAM bounce buffers,
+  * summing one while the other fills.
   * Inputs    :
   *      StartAddress  : Flash start address
   *      Size          : Size (in WORD)  
@@ -117,77 +408,248 @@ KeepInCompilation int SectorErase (uint32_t EraseStartAddress, uint32_t EraseEnd
   */
 uint32_t CheckSum(uint32_t StartAddress, uint32_t Size, uint32_t InitVal)
 {
-  uint8_t missalignementAddress = StartAddress%4;
-  uint8_t missalignementSize = Size ;
-  int cnt;
-  uint32_t Val;
-	
-  StartAddress-=StartAddress%4;
-  Size += (Size%4==0)?0:4-(Size%4);
-  
-  for(cnt=0; cnt<Size ; cnt+=4)
+  flash_stream(StartAddress & 0x0FFFFFFF, Size, checksum_sink, &InitVal);
+
+  return (InitVal);
+}
+
+
+/*
+ * flash_stream sink for Crc32
+ */
+static void crc32_sink(const uint32_t *data, uint32_t length, void *ctx)
+{
+  crc32_update(data, length);
+}
+
+
+/**
+  * Description :
+  * Calculates the CRC-32 (IEEE 802.3, as zlib) of a flash range on target
+  * with the CRC peripheral, fed by DMA quad reads.
+  * Inputs    :
+  *      StartAddress  : Flash start address
+  *      Size          : Size (in BYTES)
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  *     R1             : CRC-32 value, only valid when R0 is 1
+  */
+KeepInCompilation uint64_t Crc32 (uint32_t StartAddress, uint32_t Size)
+{
+  crc32_init();
+
+  if (flash_stream(StartAddress & 0x0FFFFFFF, Size, crc32_sink, NULL) != 0)
+    return 0;
+
+  return (((uint64_t)crc32_final()<<32) + 1);
+}
+
+
+/* CRC-32 of every subsector, filled by SectorCrcIndex, read back by the host */
+KeepInCompilation uint32_t SectorCrcTable[QSPI_MEM_SIZE / QSPI_SECTOR_SIZE];
+
+/* Running state of the SectorCrcIndex pass */
+struct sector_crc_state
+{
+  uint32_t sector;            /* index of the sector being summed */
+  uint32_t left;              /* bytes still to come in that sector */
+};
+
+/*
+ * flash_stream sink for SectorCrcIndex, closes a CRC at every sector boundary
+ */
+static void sector_crc_sink(const uint32_t *data, uint32_t length, void *ctx)
+{
+  struct sector_crc_state *state = ctx;
+  uint32_t n;
+
+  while (length)
   {
-    Val = *(uint32_t*)StartAddress;
-    if(missalignementAddress)
-    {
-      switch (missalignementAddress)
-      {
-        case 1:
-          InitVal += (uint8_t) (Val>>8 & 0xff);
-          InitVal += (uint8_t) (Val>>16 & 0xff);
-          InitVal += (uint8_t) (Val>>24 & 0xff);
-          missalignementAddress-=1;
-          break;
-        case 2:
-          InitVal += (uint8_t) (Val>>16 & 0xff);
-          InitVal += (uint8_t) (Val>>24 & 0xff);
-          missalignementAddress-=2;
-          break;
-        case 3:   
-          InitVal += (uint8_t) (Val>>24 & 0xff);
-          missalignementAddress-=3;
-          break;
-      }  
-    }
-    else if((Size-missalignementSize)%4 && (Size-cnt) <=4)
+    n = (length < state->left) ? length : state->left;
+    crc32_update(data, n);
+    data += n >> 2;
+    length -= n;
+    state->left -= n;
+
+    if (state->left == 0)
     {
-      switch (Size-missalignementSize)
-      {
-        case 1:
-          InitVal += (uint8_t) Val;
-          InitVal += (uint8_t) (Val>>8 & 0xff);
-          InitVal += (uint8_t) (Val>>16 & 0xff);
-          missalignementSize-=1;
-          break;
-        case 2:
-          InitVal += (uint8_t) Val;
-          InitVal += (uint8_t) (Val>>8 & 0xff);
-          missalignementSize-=2;
-          break;
-        case 3:   
-          InitVal += (uint8_t) Val;
-          missalignementSize-=3;
-          break;
-      } 
+      SectorCrcTable[state->sector++] = crc32_final();
+      state->left = QSPI_SECTOR_SIZE;
+      crc32_init();
     }
-    else
+  }
+}
+
+
+/**
+  * Description :
+  * Fills SectorCrcTable with the CRC-32 of every 4K sector touching the
+  * range, in one streaming pass. Entry n belongs to the sector at n * 4K,
+  * entries outside the range are left alone.
+  * Inputs    :
+  *      StartAddress  : Flash start address
+  *      Size          : Size (in BYTES)
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  */
+KeepInCompilation int SectorCrcIndex (uint32_t StartAddress, uint32_t Size)
+{
+  struct sector_crc_state state;
+  uint32_t end;
+
+  StartAddress &= 0x0FFFFFFF;
+  if (Size == 0)
+    return 1;
+
+  /* Round out to whole sectors, clipped to the device */
+  end = StartAddress + Size;
+  StartAddress -= StartAddress % QSPI_SECTOR_SIZE;
+  end += (QSPI_SECTOR_SIZE - end % QSPI_SECTOR_SIZE) % QSPI_SECTOR_SIZE;
+  if (end > QSPI_MEM_SIZE)
+    end = QSPI_MEM_SIZE;
+  if (StartAddress >= end)
+    return 0;
+
+  state.sector = StartAddress / QSPI_SECTOR_SIZE;
+  state.left = QSPI_SECTOR_SIZE;
+  crc32_init();
+
+  return !flash_stream(StartAddress, end - StartAddress, sector_crc_sink, &state);
+}
+
+
+/* Digest of the last Sha256 call, read back by the host */
+KeepInCompilation struct DigestResult Sha256Result;
+
+/*
+ * flash_stream sink for Sha256
+ */
+static void sha256_sink(const uint32_t *data, uint32_t length, void *ctx)
+{
+  sha256_update(ctx, (const uint8_t *)data, length);
+}
+
+
+/**
+  * Description :
+  * Calculates the SHA-256 digest of a flash range on target, streamed by
+  * DMA quad reads, and leaves it in Sha256Result.
+  * Inputs    :
+  *      StartAddress  : Flash start address
+  *      Size          : Size (in BYTES)
+  * outputs   :
+  *     R0             : 1 Operation succeeded, 0 Operation failed
+  *     Sha256Result   : Status (same as R0), range and digest
+  */
+KeepInCompilation int Sha256 (uint32_t StartAddress, uint32_t Size)
+{
+  sha256_ctx ctx;
+
+  Sha256Result.Status = 0;
+  Sha256Result.StartAddress = StartAddress;
+  Sha256Result.Size = Size;
+
+  sha256_init(&ctx);
+  if (flash_stream(StartAddress & 0x0FFFFFFF, Size, sha256_sink, &ctx) != 0)
+    return 0;
+  sha256_final(&ctx, Sha256Result.Digest);
+
+  Sha256Result.Status = 1;
+  return 1;
+}
+
+
+/*
+ * Compare Size bytes of mapped flash against RAM, adding the flash bytes
+ * to *sum as they go. Whole words are compared and summed while both
+ * pointers are word aligned, bytes otherwise.
+ * Returns the number of leading bytes that matched.
+ */
+static uint32_t compare_sum(const uint8_t *flash, const uint8_t *ram, uint32_t Size, uint32_t *sum)
+{
+  uint32_t done = 0;
+  uint32_t acc = *sum;
+  uint32_t w;
+
+  while (done < Size && (((uint32_t)(flash + done) | (uint32_t)(ram + done)) & 3))
+  {
+    if (flash[done] != ram[done])
+      break;
+    acc += flash[done++];
+  }
+
+  if ((((uint32_t)(flash + done) | (uint32_t)(ram + done)) & 3) == 0)
+  {
+    while (Size - done >= 4)
     {
-      InitVal += (uint8_t) Val;
-      InitVal += (uint8_t) (Val>>8 & 0xff);
-      InitVal += (uint8_t) (Val>>16 & 0xff);
-      InitVal += (uint8_t) (Val>>24 & 0xff);
+      w = *(const uint32_t *)(flash + done);
+      if (w != *(const uint32_t *)(ram + done))
+        break;                    /* the byte loop below finds the failing byte */
+      acc += (w & 0xff) + ((w >> 8) & 0xff) + ((w >> 16) & 0xff) + (w >> 24);
+      done += 4;
     }
-    StartAddress+=4;
   }
-  
-  return (InitVal);
+
+  while (done < Size && flash[done] == ram[done])
+    acc += flash[done++];
+
+  *sum = acc;
+  return done;
+}
+
+#if QSPI_MIRROR
+/*
+ * compare_sum for mirror mode, the mapped flash holds every byte twice,
+ * the BK1 copy first. Both copies have to match RAM, the BK1 one is summed.
+ */
+static uint32_t compare_sum_mirror(const uint8_t *flash, const uint8_t *ram, uint32_t Size, uint32_t *sum)
+{
+  const uint16_t *pair = (const uint16_t *)flash;
+  uint32_t done = 0;
+  uint32_t acc = *sum;
+
+  while (done < Size && pair[done] == ram[done] * 0x0101U)
+    acc += ram[done++];
+
+  *sum = acc;
+  return done;
+}
+#endif
+
+/*
+ * compare_sum over the offsets [from, to) of the range at flash address
+ * 'address', one mapped bank at a time.
+ * Returns the offset of the first mismatch, 'to' if all matched.
+ */
+static uint32_t compare_range(uint32_t address, const uint8_t *ram, uint32_t from, uint32_t to, uint32_t *sum)
+{
+  const uint8_t *flash;
+  uint32_t len, n;
+
+  while (from < to)
+  {
+    len = flash_span(address + from, to - from);
+    if ((flash = flash_map(address + from)) == NULL)
+      return from;
+
+#if QSPI_MIRROR
+    n = compare_sum_mirror(flash, ram + from, len, sum);
+#else
+    n = compare_sum(flash, ram + from, len, sum);
+#endif
+    from += n;
+    if (n < len)
+      return from;
+  }
+
+  return to;
 }
 
 
 /**
   * Description :
   * Verify flash memory with RAM buffer and calculates checksum value of
-  * the programmed memory
+  * the programmed memory, in a single pass over the memory mapped flash
   * Inputs    :
   *      FlashAddr     : Flash address
   *      RAMBufferAddr : RAM buffer address
@@ -200,55 +662,162 @@ uint32_t CheckSum(uint32_t StartAddress, uint32_t Size, uint32_t InitVal)
   */
 KeepInCompilation uint64_t Verify (uint32_t MemoryAddr, uint32_t RAMBufferAddr, uint32_t Size, uint32_t missalignement)
 {
-#if 0
-  uint32_t VerifiedData = 0, InitVal = 0;
-  uint64_t checksum;
+  const uint8_t *ram;
+  uint32_t checksum = 0, unused = 0;
+  uint32_t sum_start, sum_end, cmp_end, n;
+  uint32_t address;
   Size*=4;
-  QSPI_MemoryMappedTypeDef sMemMappedCfg;
-  QSPIHandle.Init.ClockPrescaler     = 0;
-  QSPIHandle.Init.FifoThreshold      = 4;
-  QSPIHandle.Init.SampleShifting     = QSPI_SAMPLE_SHIFTING_NONE;
-  QSPIHandle.Init.FlashSize          = 0x1F;
-  QSPIHandle.Init.ChipSelectHighTime = QSPI_CS_HIGH_TIME_1_CYCLE;
-  QSPIHandle.Init.ClockMode          = QSPI_CLOCK_MODE_0;  
-  
-  /* Configure Volatile Configuration register (with new dummy cycles) */
-  QSPIHandle.State = HAL_QSPI_STATE_READY;
-  
-  //QSPI_DummyCyclesCfg(&QSPIHandle);
-
-
-  sCommand.InstructionMode   = QSPI_INSTRUCTION_1_LINE;
-  sCommand.AddressSize       = QSPI_ADDRESS_32_BITS;
-  sCommand.AddressMode       = QSPI_ADDRESS_4_LINES;
-  sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-  sCommand.AlternateBytesSize= QSPI_ALTERNATE_BYTES_8_BITS;
-  sCommand.DataMode          = QSPI_DATA_4_LINES;
-  sCommand.DdrMode           = QSPI_DDR_MODE_DISABLE;
-  sCommand.DdrHoldHalfCycle  = QSPI_DDR_HHC_ANALOG_DELAY;
-  sCommand.SIOOMode          = QSPI_SIOO_INST_EVERY_CMD;
-  sCommand.DummyCycles       = DUMMY_CLOCK_CYCLES_READ_QUAD;
-  sCommand.Instruction       = QUAD_INOUT_FAST_READ_CMD;
-
-  sMemMappedCfg.TimeOutActivation = QSPI_TIMEOUT_COUNTER_DISABLE; 
-  QSPIHandle.State = HAL_QSPI_STATE_READY;
-  HAL_QSPI_MemoryMapped(&QSPIHandle, &sCommand, &sMemMappedCfg);
-
-
-  checksum = CheckSum((uint32_t)MemoryAddr + (missalignement & 0xf), Size - ((missalignement >> 16) & 0xF), InitVal);
-  while (Size>VerifiedData)
+
+  /* Compare against the memory mapped window */
+  address = MemoryAddr & 0x0FFFFFFF;
+  MemoryAddr = FLASH_MAPPED_BASE + address;
+
+  ram = (const uint8_t *)RAMBufferAddr;
+
+  /* Checksum covers [sum_start, sum_end), comparison [0, Size) */
+  sum_start = missalignement & 0xf;
+  sum_end = sum_start + Size - ((missalignement >> 16) & 0xF);
+  if (sum_start > Size)
+    sum_start = Size;
+  if (sum_end < sum_start)
+    sum_end = sum_start;
+  cmp_end = (sum_end < Size) ? sum_end : Size;
+
+  /* Compared, not summed */
+  n = compare_range(address, ram, 0, sum_start, &unused);
+  if (n < sum_start)
+    return (((uint64_t)checksum<<32) + (MemoryAddr + n));
+
+  /* Compared and summed in the same pass */
+  n = compare_range(address, ram, sum_start, cmp_end, &checksum);
+  if (n < cmp_end)
+    return (((uint64_t)checksum<<32) + (MemoryAddr + n));
+
+  /* Compared, not summed */
+  n = compare_range(address, ram, cmp_end, Size, &unused);
+  if (n < Size)
+    return (((uint64_t)checksum<<32) + (MemoryAddr + n));
+
+  /* Summed past the compared data */
+  if (sum_end > Size)
+    checksum = CheckSum(MemoryAddr + Size, sum_end - Size, checksum);
+
+  return (((uint64_t)checksum<<32) + (MemoryAddr + Size));
+}
+
+
+/*
+ * Run one RunBatch descriptor, returns nonzero on failure
+ */
+static int run_command(struct BatchCommand *cmd)
+{
+  uint32_t address = cmd->Address & 0x0FFFFFFF;
+  uint32_t n, unused = 0;
+
+  cmd->Result = 0;
+
+  switch (cmd->Op)
   {
-    if ( *(uint8_t*)MemoryAddr++ != *((uint8_t*)RAMBufferAddr + VerifiedData))
-      return ((checksum<<32) + (MemoryAddr + VerifiedData));  
-   
-    VerifiedData++;  
+  case BATCH_ERASE:
+    return cmd->Size && flash_erase_range(address, cmd->Size);
+
+  case BATCH_PROGRAM:
+    return flash_write(address, (uint8_t *)cmd->Buffer, cmd->Size);
+
+  case BATCH_VERIFY:
+    n = compare_range(address, (const uint8_t *)cmd->Buffer, 0, cmd->Size, &unused);
+    cmd->Result = FLASH_MAPPED_BASE + address + n;
+    return n < cmd->Size;
+
+  case BATCH_CRC:
+    crc32_init();
+    if (flash_stream(address, cmd->Size, crc32_sink, NULL) != 0)
+      return 1;
+    cmd->Result = crc32_final();
+    return 0;
+
+  case BATCH_BLANK_CHECK:
+    return !flash_is_blank(address, cmd->Size);
+
+  default:
+    return 1;
   }
-        
-  return (checksum<<32);
-#endif
+}
 
-  return 0;
 
+/*
+ * Wait for the erases the first count descriptors left running, newest
+ * first: the erase still pending on a part is the last one that touched it.
+ * A timeout fails the erase descriptor it belongs to. One seen earlier, when
+ * a later descriptor selected the part, failed that descriptor instead.
+ */
+static int batch_sync(struct BatchCommand *cmd, uint32_t count)
+{
+  uint32_t address, first, last, b;
+  int failed = 0;
+
+  while (count--)
+  {
+    if (cmd[count].Op != BATCH_ERASE || cmd[count].Status == BATCH_PENDING || cmd[count].Size == 0)
+      continue;
+
+    address = cmd[count].Address & 0x0FFFFFFF;
+    first = address / QSPI_BANK_SIZE;
+    last = (address + cmd[count].Size - 1) / QSPI_BANK_SIZE;
+    for (b = first; b <= last && b < QSPI_BANKS; b++)
+    {
+      if (flash_wait(b * QSPI_BANK_SIZE) != 0)
+      {
+        cmd[count].Status = BATCH_FAILED;
+        failed = 1;
+      }
+    }
+  }
+
+  return failed;
+}
+
+
+/**
+  * Description :
+  * Runs a list of erase, program, verify, CRC and blank check descriptors
+  * in one call. Every descriptor gets its Status (and Result) written back
+  * in place; the list stops at the first failure, the descriptors after it
+  * are left BATCH_PENDING. With two banks an erase runs on while the next
+  * descriptors use the other part, so erasing one part overlaps programming
+  * the other; every erase is waited for before RunBatch returns.
+  * Inputs    :
+  *      ListAddress   : RAM address of the struct BatchCommand array
+  *      Count         : Number of descriptors
+  * outputs   :
+  *     R0             : 1 all descriptors succeeded, 0 one failed
+  */
+KeepInCompilation int RunBatch (uint32_t ListAddress, uint32_t Count)
+{
+  struct BatchCommand *cmd = (struct BatchCommand *)ListAddress;
+  uint32_t i;
+  int ok = 1;
+
+  for (i = 0; i < Count; i++)
+    cmd[i].Status = BATCH_PENDING;
+
+  for (i = 0; i < Count; i++)
+  {
+    if (run_command(&cmd[i]) != 0)
+    {
+      cmd[i].Status = BATCH_FAILED;
+      ok = 0;
+      break;
+    }
+    cmd[i].Status = BATCH_OK;
+  }
+
+  /* Erases still running on either part are collected before returning,
+     a failed descriptor may have started some as well */
+  if (batch_sync(cmd, ok ? i : i + 1) != 0)
+    ok = 0;
+
+  return ok;
 }
 
 
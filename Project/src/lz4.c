@@ -0,0 +1,134 @@
+/**
+ *
+ * \file
+ *
+ * LZ4 block decompression.
+ *
+ * Literals and matches are copied eight bytes at a time with unaligned word
+ * loads and stores, which the Cortex-M7 does at full speed from RAM. Matches
+ * closer than a word are copied bytewise, they repeat their own output.
+ * Every length is checked against both buffers, a bad block fails instead
+ * of writing past the output.
+ *
+ * Only depends on stdint, tools/lz4pack.c builds it on the host as well.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#include "lz4.h"
+
+typedef struct { uint32_t v; } __attribute__((packed, may_alias)) unaligned_word;
+
+#define LOAD32(p)		(((const unaligned_word *)(p))->v)
+#define STORE32(p, x)	(((unaligned_word *)(p))->v = (x))
+
+#define MIN_MATCH		4
+
+//
+// copy n bytes forward, s at least a word behind d if they overlap
+//
+static inline void copy_forward(uint8_t *d, const uint8_t *s, uint32_t n)
+{
+	while (n >= 8)
+	{
+		STORE32(d, LOAD32(s));
+		STORE32(d + 4, LOAD32(s + 4));
+		d += 8;
+		s += 8;
+		n -= 8;
+	}
+	if (n >= 4)
+	{
+		STORE32(d, LOAD32(s));
+		d += 4;
+		s += 4;
+		n -= 4;
+	}
+	while (n--)
+		*d++ = *s++;
+}
+
+//
+// add the extra length bytes following a token nibble of 15
+//
+static inline int read_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint32_t b;
+
+	if (*len != 15)
+		return 0;
+
+	do
+	{
+		if (*ip >= iend)
+			return 1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+//
+// decompress one block of src_len bytes into at most dst_len bytes.
+// Returns the number of bytes written, -1 for a malformed block or one
+// that doesn't fit.
+//
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_len;
+	const uint8_t *match;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_len;
+	uint32_t token, len, offset;
+
+	while (ip < iend)
+	{
+		token = *ip++;
+
+		// literals
+		len = token >> 4;
+		if (read_length(&ip, iend, &len) != 0)
+			return -1;
+		if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op))
+			return -1;
+		copy_forward(op, ip, len);
+		ip += len;
+		op += len;
+
+		// the last sequence has no match
+		if (ip == iend)
+			break;
+
+		// match
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (uint32_t)(op - dst))
+			return -1;
+
+		len = token & 15;
+		if (read_length(&ip, iend, &len) != 0)
+			return -1;
+		len += MIN_MATCH;
+		if (len > (uint32_t)(oend - op))
+			return -1;
+
+		match = op - offset;
+		if (offset >= 4)
+		{
+			copy_forward(op, match, len);
+			op += len;
+		}
+		else
+		{
+			while (len--)
+				*op++ = *match++;
+		}
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,180 @@
+/**
+ *
+ * \file
+ *
+ * SHA-256 message digest (FIPS 180-4).
+ *
+ * The STM32F767 has no HASH peripheral, so this is done in software.
+ * The compression function keeps the message schedule in a 16 word ring,
+ * unrolls the rounds eight at a time so the working variables never have
+ * to be shuffled, and loads the big-endian message words with REV.
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#include "stm32f7xx.h"
+#include "sha256.h"
+
+static const uint32_t K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define S0(x)			(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)			(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)			(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)			(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+#define CH(x, y, z)		((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+
+// message schedule word i >= 16, kept in a ring of 16
+#define W(i)			(w[(i) & 15] += s1(w[((i) - 2) & 15]) + w[((i) - 7) & 15] + s0(w[((i) - 15) & 15]))
+
+// one round, the caller rotates the variable names instead of the values
+#define ROUND(a, b, c, d, e, f, g, h, i, wi) \
+	do { \
+		uint32_t t1 = h + S1(e) + CH(e, f, g) + K[i] + (wi); \
+		d += t1; \
+		h = t1 + S0(a) + MAJ(a, b, c); \
+	} while (0)
+
+#define ROUNDS8(i, wx) \
+	do { \
+		ROUND(a, b, c, d, e, f, g, h, (i) + 0, wx((i) + 0)); \
+		ROUND(h, a, b, c, d, e, f, g, (i) + 1, wx((i) + 1)); \
+		ROUND(g, h, a, b, c, d, e, f, (i) + 2, wx((i) + 2)); \
+		ROUND(f, g, h, a, b, c, d, e, (i) + 3, wx((i) + 3)); \
+		ROUND(e, f, g, h, a, b, c, d, (i) + 4, wx((i) + 4)); \
+		ROUND(d, e, f, g, h, a, b, c, (i) + 5, wx((i) + 5)); \
+		ROUND(c, d, e, f, g, h, a, b, (i) + 6, wx((i) + 6)); \
+		ROUND(b, c, d, e, f, g, h, a, (i) + 7, wx((i) + 7)); \
+	} while (0)
+
+#define WLOAD(i)		(w[i] = __REV(data[i]))
+
+//
+// compress 'blocks' 64 byte blocks from a word aligned buffer into state
+//
+static void sha256_blocks(uint32_t *state, const uint32_t *data, uint32_t blocks)
+{
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t w[16];
+	int i;
+
+	while (blocks--)
+	{
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		ROUNDS8(0, WLOAD);
+		ROUNDS8(8, WLOAD);
+		for (i = 16; i < 64; i += 8)
+			ROUNDS8(i, W);
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		data += 16;
+	}
+}
+
+
+void sha256_init(sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->length_lo = 0;
+	ctx->length_hi = 0;
+	ctx->fill = 0;
+}
+
+
+void sha256_update(sha256_ctx *ctx, const uint8_t *data, uint32_t length)
+{
+	uint32_t n;
+
+	if ((ctx->length_lo += length) < length)
+		ctx->length_hi++;
+
+	// top up a partial block first
+	if (ctx->fill)
+	{
+		while (length && ctx->fill < SHA256_BLOCK_SIZE)
+		{
+			ctx->block.b[ctx->fill++] = *data++;
+			length--;
+		}
+		if (ctx->fill < SHA256_BLOCK_SIZE)
+			return;
+		sha256_blocks(ctx->state, ctx->block.w, 1);
+		ctx->fill = 0;
+	}
+
+	// whole blocks straight from the caller's buffer when it is word aligned
+	n = length / SHA256_BLOCK_SIZE;
+	if (n && ((uint32_t)data & 3) == 0)
+	{
+		sha256_blocks(ctx->state, (const uint32_t *)data, n);
+		data += n * SHA256_BLOCK_SIZE;
+		length -= n * SHA256_BLOCK_SIZE;
+	}
+
+	// the rest through the block buffer
+	while (length)
+	{
+		ctx->block.b[ctx->fill++] = *data++;
+		length--;
+		if (ctx->fill == SHA256_BLOCK_SIZE)
+		{
+			sha256_blocks(ctx->state, ctx->block.w, 1);
+			ctx->fill = 0;
+		}
+	}
+}
+
+
+void sha256_final(sha256_ctx *ctx, uint8_t *digest)
+{
+	uint32_t i;
+
+	// padding: 0x80, zeros, 64-bit big-endian bit length
+	ctx->block.b[ctx->fill++] = 0x80;
+	if (ctx->fill > SHA256_BLOCK_SIZE - 8)
+	{
+		while (ctx->fill < SHA256_BLOCK_SIZE)
+			ctx->block.b[ctx->fill++] = 0;
+		sha256_blocks(ctx->state, ctx->block.w, 1);
+		ctx->fill = 0;
+	}
+	while (ctx->fill < SHA256_BLOCK_SIZE - 8)
+		ctx->block.b[ctx->fill++] = 0;
+
+	ctx->block.w[14] = __REV((ctx->length_hi << 3) | (ctx->length_lo >> 29));
+	ctx->block.w[15] = __REV(ctx->length_lo << 3);
+	sha256_blocks(ctx->state, ctx->block.w, 1);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[4 * i + 0] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+}
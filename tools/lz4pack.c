@@ -0,0 +1,275 @@
+/**
+ *
+ * \file
+ *
+ * Host side packer for the WriteLz4 entry point.
+ *
+ * Splits an image into LZ4_MAX_BLOCK sized pieces and compresses each into
+ * an independent LZ4 block behind the header described in lz4.h. Every block
+ * is decompressed again with the loader's own lz4.c and compared before it
+ * is written out, so a payload that leaves this tool round-trips on target.
+ *
+ * Build and run on Linux:
+ *
+ *   cc -O2 -I../Project/inc -o lz4pack lz4pack.c ../Project/src/lz4.c
+ *   ./lz4pack image.bin image.lz4
+ *   ./lz4pack -t            round-trip a set of generated patterns
+ *
+ * AT25Q641 External Flashloader for STM32 with QSPI.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_BITS		14
+#define MIN_MATCH		4
+#define MAX_OFFSET		0xFFFF
+#define LAST_LITERALS	5		// a block ends with at least this many literals
+#define MF_LIMIT		12		// no match starts this close to the end
+
+/* Worst case size of a compressed block of n bytes */
+#define BOUND(n)		((n) + (n) / 255 + 16)
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, uint32_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+//
+// one sequence: literals from anchor up to ip, then a match unless mlen is 0
+//
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *anchor, const uint8_t *ip, uint32_t offset, uint32_t mlen)
+{
+	uint32_t lit = ip - anchor;
+	uint8_t *token = op++;
+
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = put_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (mlen)
+	{
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+
+		mlen -= MIN_MATCH;
+		*token |= (mlen >= 15) ? 15 : mlen;
+		if (mlen >= 15)
+			op = put_length(op, mlen - 15);
+	}
+
+	return op;
+}
+
+//
+// greedy single hash LZ4 compression of one block, returns the compressed size
+//
+static uint32_t lz4_compress(const uint8_t *src, uint32_t n, uint8_t *dst)
+{
+	static uint32_t table[1 << HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *ref;
+	const uint8_t *end = src + n;
+	uint8_t *op = dst;
+	uint32_t h, len;
+
+	memset(table, 0, sizeof(table));
+
+	if (n > MF_LIMIT)
+	{
+		const uint8_t *mf_limit = end - MF_LIMIT;
+		const uint8_t *match_limit = end - LAST_LITERALS;
+
+		while (ip < mf_limit)
+		{
+			h = hash4(read32(ip));
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ref < ip && ip - ref <= MAX_OFFSET && read32(ref) == read32(ip))
+			{
+				len = MIN_MATCH;
+				while (ip + len < match_limit && ref[len] == ip[len])
+					len++;
+
+				op = put_sequence(op, anchor, ip, ip - ref, len);
+				ip += len;
+				anchor = ip;
+			}
+			else
+				ip++;
+		}
+	}
+
+	return put_sequence(op, anchor, end, 0, 0) - dst;
+}
+
+static void put_word(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+//
+// pack n bytes of image into out, returns the payload size or 0 if a block
+// fails to round-trip
+//
+static size_t pack(const uint8_t *image, size_t n, uint8_t *out)
+{
+	static uint8_t check[LZ4_MAX_BLOCK];
+	uint8_t *op = out;
+	uint32_t raw, packed;
+
+	while (n)
+	{
+		raw = (n > LZ4_MAX_BLOCK) ? LZ4_MAX_BLOCK : n;
+		packed = lz4_compress(image, raw, op + LZ4_HEADER_SIZE);
+
+		if (lz4_decompress(op + LZ4_HEADER_SIZE, packed, check, raw) != (int32_t)raw ||
+			memcmp(check, image, raw) != 0)
+			return 0;
+
+		put_word(op, packed);
+		put_word(op + 4, raw);
+		op += LZ4_HEADER_SIZE + packed;
+
+		image += raw;
+		n -= raw;
+	}
+
+	return op - out;
+}
+
+static size_t packed_bound(size_t n)
+{
+	size_t blocks = (n + LZ4_MAX_BLOCK - 1) / LZ4_MAX_BLOCK;
+
+	return BOUND(n) + blocks * (LZ4_HEADER_SIZE + 16);
+}
+
+//
+// round-trip a set of generated images, the sizes straddle the block size
+// and the short block limits
+//
+static int self_test(void)
+{
+	static const size_t sizes[] = { 0, 1, 5, 12, 13, 64, 4095, 65535, 65536, 65537, 300000 };
+	uint8_t *image, *out;
+	size_t i, k, n, packed;
+	uint32_t seed = 1;
+	int pattern, failed = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		n = sizes[i];
+		for (pattern = 0; pattern < 4; pattern++)
+		{
+			image = malloc(n + 1);
+			out = malloc(packed_bound(n));
+
+			for (k = 0; k < n; k++)
+			{
+				seed = seed * 1103515245 + 12345;
+				switch (pattern)
+				{
+				case 0: image[k] = 0xFF; break;							// erased flash
+				case 1: image[k] = seed >> 16; break;					// incompressible
+				case 2: image[k] = "flash loader "[k % 13]; break;		// text-like repeats
+				default: image[k] = (k & 0x100) ? seed >> 24 : k; break;	// mixed runs
+				}
+			}
+
+			packed = pack(image, n, out);
+			if (n && packed == 0)
+			{
+				printf("FAIL size %zu pattern %d\n", n, pattern);
+				failed = 1;
+			}
+			else
+				printf("ok   size %7zu pattern %d -> %7zu\n", n, pattern, packed);
+
+			free(image);
+			free(out);
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	uint8_t *image, *out;
+	size_t n, packed;
+
+	if (argc == 2 && strcmp(argv[1], "-t") == 0)
+		return self_test();
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s image.bin image.lz4\n       %s -t\n", argv[0], argv[0]);
+		return 2;
+	}
+
+	if ((f = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	image = malloc(n + 1);
+	out = malloc(packed_bound(n));
+	if (fread(image, 1, n, f) != n)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fclose(f);
+
+	packed = pack(image, n, out);
+	if (n && packed == 0)
+	{
+		fprintf(stderr, "%s: round-trip check failed\n", argv[1]);
+		return 1;
+	}
+
+	if ((f = fopen(argv[2], "wb")) == NULL || fwrite(out, 1, packed, f) != packed)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	fclose(f);
+
+	printf("%zu -> %zu bytes\n", n, packed);
+
+	return 0;
+}